@@ -29,42 +29,52 @@
 struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn )
 {
-    /**
-    * TODO: implement per description
-    */
-
-    uint8_t current_pos = buffer->out_offs;
-    size_t total_bytes = 0;
-    uint8_t entries_checked = 0;
-
-    // Iterate through the entries in the buffer 
-    while(entries_checked < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) {
+    uint64_t base = buffer->base_offset;
+    uint8_t low = 0;
+    uint8_t high;
+    uint8_t current_pos;
 
-        //retrieve entry at current position
-        struct aesd_buffer_entry *entry = &buffer->entry[current_pos];
+    if(char_offset >= buffer->total_size){
+        return NULL;
+    }
 
-        // Check to see if we are at our offset target
-        if(char_offset < total_bytes + entry->size){
-            // we have found our entry we need to return, first set byte_rtn
-            *entry_offset_byte_rtn = char_offset = char_offset - total_bytes;
-            return entry;
+    // Binary search for the newest entry starting at or before char_offset,
+    // offsets only grow from out_offs onwards
+    high = buffer->count - 1;
+    while(low < high){
+        uint8_t mid = low + (high - low + 1) / 2;
+
+        current_pos = (buffer->out_offs + mid) % buffer->capacity;
+        if(buffer->entry_start[current_pos] - base <= char_offset){
+            low = mid;
+        } else {
+            high = mid - 1;
         }
+    }
 
-        // Add entry byte size to our total we are tracking
-        total_bytes += entry->size;
+    current_pos = (buffer->out_offs + low) % buffer->capacity;
+    *entry_offset_byte_rtn = char_offset - (buffer->entry_start[current_pos] - base);
+    return &buffer->entry[current_pos];
+}
 
-        // Move to the next entry (if at end, wrap around)
-        current_pos = (current_pos + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-        entries_checked++;
+/**
+ * @param buffer the buffer to look in.  Any necessary locking must be performed by caller.
+ * @param entry_index the zero referenced index of the entry, 0 being the oldest
+ * @param char_offset_rtn is a pointer specifying a location to store the offset of the first byte of the
+ *      returned entry if all buffer strings were concatenated end to end.  Only set when the entry exists.
+ * @return the entry at @param entry_index, or NULL if fewer entries are stored.
+ */
+struct aesd_buffer_entry *aesd_circular_buffer_entry_at(struct aesd_circular_buffer *buffer,
+            size_t entry_index, size_t *char_offset_rtn)
+{
+    uint8_t current_pos;
 
-        // Discontinue if we have went through all active entries and we have already reached in_offs and the buffer isn't full
-        if(!buffer->full && current_pos == buffer->in_offs){
-            break;
-        }
+    if(entry_index >= buffer->count){
+        return NULL;
     }
-
-
-    return NULL;
+    current_pos = (buffer->out_offs + entry_index) % buffer->capacity;
+    *char_offset_rtn = buffer->entry_start[current_pos] - buffer->base_offset;
+    return &buffer->entry[current_pos];
 }
 
 /**
@@ -80,25 +90,74 @@ void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const s
     * TODO: implement per description
     */
 
+    // The new entry starts where the newest one ends
+    uint64_t end = buffer->base_offset + buffer->total_size;
+
+    // The entry about to be overwritten drops out of the totals
+    if(buffer->full){
+        buffer->total_size -= buffer->entry[buffer->in_offs].size;
+        buffer->base_offset += buffer->entry[buffer->in_offs].size;
+    } else {
+        buffer->count++;
+    }
+
     // Store the new entry in the buffer, always place the new entry in the in_offs position
     buffer->entry[buffer->in_offs] = *add_entry;
+    buffer->entry_start[buffer->in_offs] = end;
+    buffer->total_size += add_entry->size;
 
     // If the buffer was already full, we need to move ahead out_offs and overwrite the old entry
     if(buffer->full){
-        buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        buffer->out_offs = (buffer->out_offs + 1) % buffer->capacity;
     }
 
     // Advance the in_oofs since we are writing and moving to the next position in the buffer
-    buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    buffer->in_offs = (buffer->in_offs + 1) % buffer->capacity;
 
     // Set flag if buffer is full or false if not full
     buffer->full = (buffer->in_offs == buffer->out_offs);
 }
 
+/**
+* Removes the oldest entry of @param buffer, copying it to @param removed_entry so the caller can release
+* its memory.
+* Any necessary locking must be handled by the caller
+* @return true if an entry was removed, false if @param buffer was empty.
+*/
+bool aesd_circular_buffer_remove_entry(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *removed_entry)
+{
+    if(buffer->count == 0){
+        return false;
+    }
+
+    *removed_entry = buffer->entry[buffer->out_offs];
+    buffer->total_size -= removed_entry->size;
+    buffer->base_offset += removed_entry->size;
+
+    // Clear the slot, AESD_CIRCULAR_BUFFER_FOREACH users free whatever is left
+    buffer->entry[buffer->out_offs].buffptr = NULL;
+    buffer->entry[buffer->out_offs].size = 0;
+
+    buffer->out_offs = (buffer->out_offs + 1) % buffer->capacity;
+    buffer->count--;
+    buffer->full = false;
+    return true;
+}
+
 /**
 * Initializes the circular buffer described by @param buffer to an empty struct
 */
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
+{
+    aesd_circular_buffer_init_depth(buffer, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED);
+}
+
+/**
+* Initializes the circular buffer described by @param buffer to an empty struct holding up to @param depth
+* entries, between 1 and AESDCHAR_MAX_HISTORY_DEPTH
+*/
+void aesd_circular_buffer_init_depth(struct aesd_circular_buffer *buffer, uint8_t depth)
 {
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    buffer->capacity = depth;
 }
@@ -16,7 +16,14 @@
 #include <stdbool.h>
 #endif
 
+/**
+ * Depth of a buffer set up with aesd_circular_buffer_init()
+ */
 #define AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED 10
+/**
+ * Deepest buffer aesd_circular_buffer_init_depth() can set up, bounded by the uint8_t offsets
+ */
+#define AESDCHAR_MAX_HISTORY_DEPTH 255
 
 struct aesd_buffer_entry
 {
@@ -35,7 +42,7 @@ struct aesd_circular_buffer
     /**
      * An array of pointers to memory allocated for the most recent write operations
      */
-    struct aesd_buffer_entry  entry[AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+    struct aesd_buffer_entry  entry[AESDCHAR_MAX_HISTORY_DEPTH];
     /**
      * The current location in the entry structure where the next write should
      * be stored.
@@ -49,15 +56,45 @@ struct aesd_circular_buffer
      * set to true when the buffer entry structure is full
      */
     bool full;
+    /**
+     * Number of entries currently stored
+     */
+    uint8_t count;
+    /**
+     * Sum of the sizes of the entries currently stored
+     */
+    size_t total_size;
+    /**
+     * Offset of the oldest entry in the stream of every byte ever added, the
+     * number of bytes evicted so far
+     */
+    uint64_t base_offset;
+    /**
+     * Start of each entry in the stream of every byte ever added, so that
+     * evicting the oldest entry does not shift the others.  Subtract
+     * base_offset for the offset within the buffer.
+     */
+    uint64_t entry_start[AESDCHAR_MAX_HISTORY_DEPTH];
+    /**
+     * Number of entries in use, the buffer is full once it holds this many
+     */
+    uint8_t capacity;
 };
 
 extern struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(struct aesd_circular_buffer *buffer,
             size_t char_offset, size_t *entry_offset_byte_rtn );
 
+extern struct aesd_buffer_entry *aesd_circular_buffer_entry_at(struct aesd_circular_buffer *buffer,
+            size_t entry_index, size_t *char_offset_rtn);
+
 extern void aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry);
 
+extern bool aesd_circular_buffer_remove_entry(struct aesd_circular_buffer *buffer, struct aesd_buffer_entry *removed_entry);
+
 extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
 
+extern void aesd_circular_buffer_init_depth(struct aesd_circular_buffer *buffer, uint8_t depth);
+
 /**
  * Create a for loop to iterate over each member of the circular buffer.
  * Useful when you've allocated memory for circular buffer entries and need to free it
@@ -74,7 +111,7 @@ extern void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer);
  */
 #define AESD_CIRCULAR_BUFFER_FOREACH(entryptr,buffer,index) \
     for(index=0, entryptr=&((buffer)->entry[index]); \
-            index<AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; \
+            index<(buffer)->capacity; \
             index++, entryptr=&((buffer)->entry[index]))
 
 
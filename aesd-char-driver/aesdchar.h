@@ -27,6 +27,7 @@ struct aesd_dev
 {
     struct aesd_circular_buffer circular_buffer;
     struct aesd_buffer_entry working_entry;
+    size_t working_capacity;    // Bytes allocated for working_entry.buffptr
     struct mutex lock;
     struct cdev cdev;
 };
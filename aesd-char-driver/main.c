@@ -19,6 +19,9 @@
 #include <linux/cdev.h>
 #include <linux/fs.h>
 #include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/err.h>
+#include <linux/stat.h>
 #include <linux/uaccess.h>
 #include "aesdchar.h"
 #include "aesd_ioctl.h"
@@ -29,27 +32,22 @@ int aesd_minor = 0;
 MODULE_AUTHOR("Jon Holmberg");
 MODULE_LICENSE("Dual BSD/GPL");
 
+static unsigned int history_depth = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+module_param(history_depth, uint, S_IRUGO);
+MODULE_PARM_DESC(history_depth, "Number of commands kept, up to 255 (default 10)");
+
+static unsigned long history_bytes = 0;
+module_param(history_bytes, ulong, S_IRUGO);
+MODULE_PARM_DESC(history_bytes, "Bytes of commands kept, older ones are evicted first, 0 for no limit (default 0)");
+
 struct aesd_dev aesd_device;
 
 // Helper function to calculate total size of all the content in the circular buffer
 static size_t aesd_get_total_size(struct aesd_dev *dev)
 {
-    size_t total_size = 0;
-    int i;
-
-
-    // Working entry if partial command
-    if(dev->working_entry.buffptr){
-        total_size += dev->working_entry.size;
-    }
-
-    // Using circular buffer
-    for(i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++){
-        if(dev->circular_buffer.entry[i].buffptr){
-            total_size += dev->circular_buffer.entry[i].size;
-        }
-    }
-    return total_size;
+    // Kept up to date by the circular buffer as entries come and go, plus
+    // the working entry if partial command
+    return dev->circular_buffer.total_size + dev->working_entry.size;
 }
 
 int aesd_open(struct inode *inode, struct file *filp)
@@ -78,6 +76,7 @@ ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
     size_t entry_offset_byte = 0;
     struct aesd_buffer_entry *entry = NULL;
     size_t to_read;
+    uint8_t index;
     
     PDEBUG("read %zu bytes with offset %lld", count, *f_pos);
 
@@ -91,19 +90,33 @@ ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
         goto out;
     }
     
-    to_read = entry->size - entry_offset_byte;
-    if(to_read > count)
-        to_read = count;
+    // Walk forward through the following entries until count is filled or
+    // the newest entry is done, a single read takes the whole history
+    index = entry - dev->circular_buffer.entry;
+    while (retval < count) {
+        to_read = entry->size - entry_offset_byte;
+        if(to_read > count - retval)
+            to_read = count - retval;
+
+        // Safely copy data to user space
+        if(copy_to_user(buf + retval, entry->buffptr + entry_offset_byte, to_read)){
+            // Report what was copied before the fault, if anything
+            if (retval == 0)
+                retval = -EFAULT;
+            break;
+        }
+        retval += to_read;
+        entry_offset_byte = 0;
 
-    // Safely copy data to user space
-    if(copy_to_user(buf, entry->buffptr + entry_offset_byte, to_read)){
-        retval = -EFAULT;
-        goto out;
+        index = (index + 1) % dev->circular_buffer.capacity;
+        if (index == dev->circular_buffer.in_offs)
+            break;
+        entry = &dev->circular_buffer.entry[index];
     }
     
     // Update file position after read
-    *f_pos += to_read;
-    retval = to_read;
+    if (retval > 0)
+        *f_pos += retval;
 
 out:
     mutex_unlock(&dev->lock);
@@ -115,9 +128,6 @@ static long aesd_adjust_file_offset(struct file *filp, unsigned int write_cmd, u
     struct aesd_dev *dev = filp->private_data;
     struct aesd_buffer_entry *entry = NULL;
     size_t total_offset = 0;
-    int i;
-    int cmd_index;
-    int total_commands;
 
     PDEBUG("Adjusting file offset: cmd=%u, offset=%u", write_cmd, write_cmd_offset);
 
@@ -125,28 +135,17 @@ static long aesd_adjust_file_offset(struct file *filp, unsigned int write_cmd, u
     if(mutex_lock_interruptible(&dev->lock))
         return -ERESTARTSYS;
 
-    // Count total number of commands in the circular buffer
-    total_commands = 0;
-    for(i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++){
-        if(dev->circular_buffer.entry[i].buffptr != NULL){
-            total_commands++;
-        }
-    }
-
-    PDEBUG("Total commands in buffer: %d", total_commands);
+    // Look up the entry for write_cmd and the byte offset it starts at, the
+    // buffer keeps both so no need to walk the entries before it
+    entry = aesd_circular_buffer_entry_at(&dev->circular_buffer, write_cmd, &total_offset);
 
     // Make sure write_cmd is within range (not larger than total buffer entries)
-    if(write_cmd >= total_commands){
-        PDEBUG("Invalid write_cmd: %u >= %d", write_cmd, total_commands);
+    if(entry == NULL){
+        PDEBUG("Invalid write_cmd: %u >= %u", write_cmd, dev->circular_buffer.count);
         mutex_unlock(&dev->lock);
         return -EINVAL;
     }
 
-    // Calculate which entry in circular buffer = write_cmd and assign to entry
-    cmd_index = (dev->circular_buffer.out_offs + write_cmd) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-
-    entry = &dev->circular_buffer.entry[cmd_index];
-
     // Make sure the provided write_cmd_offset is within the command length size
     if(write_cmd_offset >= entry->size){
         PDEBUG("Invalid write_cmd_offset: %u >- %zu", write_cmd_offset, entry->size);
@@ -154,13 +153,6 @@ static long aesd_adjust_file_offset(struct file *filp, unsigned int write_cmd, u
         return -EINVAL;
     }
 
-    // Calculate total byte offset from the beginning of the buffer to this write_cmd
-    for(i = 0; i < write_cmd; i++){
-        int prev_cmd_index = (dev->circular_buffer.out_offs + i) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-        struct aesd_buffer_entry *prev_entry = &dev->circular_buffer.entry[prev_cmd_index];
-        total_offset += prev_entry->size;
-    }
-
     // Add the offset within the target command
     total_offset += write_cmd_offset;
 
@@ -209,6 +201,19 @@ static long aesd_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
             retval = aesd_adjust_file_offset(filp, seekto.write_cmd, seekto.write_cmd_offset);
             break;
         }
+        case AESDCHAR_IOCGBASE: {
+            struct aesd_dev *dev = filp->private_data;
+            uint64_t base;
+
+            mutex_lock(&dev->lock);
+            base = dev->circular_buffer.base_offset;
+            mutex_unlock(&dev->lock);
+
+            if(copy_to_user((void __user *)arg, &base, sizeof(base))){
+                retval = -EFAULT;
+            }
+            break;
+        }
         default:
             PDEBUG("Unkown ioctl command");
             retval = -ENOTTY;
@@ -246,66 +251,81 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
 {
     struct aesd_dev *dev = filp->private_data;
     ssize_t retval = -ENOMEM;
+    char *data;
     char *new_buffer = NULL;
-    int newline_found = 0;
-    size_t i;
     struct aesd_buffer_entry new_entry;
     
     PDEBUG("write %zu bytes with offset %lld", count, *f_pos);
 
-    if(*f_pos != 0){
-        return -ESPIPE; //Illegal seek for write
-    }
+    if (count == 0)
+        return 0;
+
+    // Writes always append, whatever the file position.  Copy the user
+    // buffer in one go before taking the lock, a fault or a slow page
+    // never holds up the other writers.
+    data = memdup_user(buf, count);
+    if (IS_ERR(data))
+        return PTR_ERR(data);
     
-    if (mutex_lock_interruptible(&dev->lock))
+    if (mutex_lock_interruptible(&dev->lock)) {
+        kfree(data);
         return -ERESTARTSYS;
-    
-    // Check for newline in the new incoming data
-    for (i = 0; i < count; i++) {
-        char c;
-        if (copy_from_user(&c, buf + i, 1)) {
-            retval = -EFAULT;
-            goto out;
-        }
-        if (c == '\n') {
-            newline_found = 1;
-            break;
-        }
     }
     
-    // Allocate space for existing partial entry + new data
-    new_buffer = kmalloc(dev->working_entry.size + count, GFP_KERNEL);
-    if (!new_buffer) {
-        retval = -ENOMEM;
+    // A command over the byte budget could never be kept
+    if (history_bytes && dev->working_entry.size + count > history_bytes) {
+        retval = -EFBIG;
         goto out;
     }
-    
-    // Copy existing partial entry data if any
-    if (dev->working_entry.size > 0 && dev->working_entry.buffptr) {
-        memcpy(new_buffer, dev->working_entry.buffptr, dev->working_entry.size);
-        kfree(dev->working_entry.buffptr);
-    }
-    
-    // Copy new data
-    if (copy_from_user(new_buffer + dev->working_entry.size, buf, count)) {
-        kfree(new_buffer);
-        retval = -EFAULT;
-        goto out;
+
+    if (dev->working_entry.size == 0) {
+        // Nothing pending, the copy becomes the entry as is
+        dev->working_entry.buffptr = data;
+        dev->working_capacity = count;
+        data = NULL;
+    } else {
+        // Grow the partial entry geometrically, a long command written in
+        // small pieces costs linear time rather than a copy per write
+        if (dev->working_entry.size + count > dev->working_capacity) {
+            size_t new_capacity = max(dev->working_capacity * 2,
+                                      dev->working_entry.size + count);
+
+            if (history_bytes && new_capacity > history_bytes)
+                new_capacity = history_bytes;
+
+            new_buffer = krealloc(dev->working_entry.buffptr, new_capacity, GFP_KERNEL);
+            if (!new_buffer) {
+                retval = -ENOMEM;
+                goto out;
+            }
+            dev->working_entry.buffptr = new_buffer;
+            dev->working_capacity = new_capacity;
+        }
+        memcpy((char *)dev->working_entry.buffptr + dev->working_entry.size, data, count);
     }
     
-    dev->working_entry.buffptr = new_buffer;
     dev->working_entry.size += count;
     
-    // If we found a newline, add to circ buffer
-    if (newline_found) {
-        // Free the buffer that will be overwritten in circular buffer if is full
-        if (dev->circular_buffer.full) {
-            // When buffer is full, the entry at out_offs will be overwritten
-            struct aesd_buffer_entry *old_entry = 
-                &dev->circular_buffer.entry[dev->circular_buffer.out_offs];
-            if (old_entry->buffptr) {
-                kfree(old_entry->buffptr);
-            }
+    // If the new data holds a newline, add to circ buffer
+    if (memchr(dev->working_entry.buffptr + dev->working_entry.size - count, '\n', count)) {
+        // Evict the oldest commands until the new one fits both the
+        // depth and the byte budget
+        while (dev->circular_buffer.full ||
+               (history_bytes && dev->circular_buffer.total_size + dev->working_entry.size > history_bytes)) {
+            struct aesd_buffer_entry old_entry;
+
+            if (!aesd_circular_buffer_remove_entry(&dev->circular_buffer, &old_entry))
+                break;
+            kfree(old_entry.buffptr);
+        }
+        
+        // Give back the slack left by geometric growth, the history and
+        // history_bytes account for the size only.  A failed shrink keeps
+        // the larger buffer intact.
+        if (dev->working_capacity > dev->working_entry.size) {
+            new_buffer = krealloc(dev->working_entry.buffptr, dev->working_entry.size, GFP_KERNEL);
+            if (new_buffer)
+                dev->working_entry.buffptr = new_buffer;
         }
         
         // Create the new entry to add
@@ -318,6 +338,7 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
         // Reset working entry
         dev->working_entry.buffptr = NULL;
         dev->working_entry.size = 0;
+        dev->working_capacity = 0;
     }
     
     retval = count;
@@ -327,6 +348,7 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
 
 out:
     mutex_unlock(&dev->lock);
+    kfree(data);
     return retval;
 }
 
@@ -359,6 +381,12 @@ int aesd_init_module(void)
     dev_t dev = 0;
     int result;
     
+    if (history_depth < 1 || history_depth > AESDCHAR_MAX_HISTORY_DEPTH) {
+        printk(KERN_WARNING "history_depth %u out of range 1 to %d\n",
+               history_depth, AESDCHAR_MAX_HISTORY_DEPTH);
+        return -EINVAL;
+    }
+
     result = alloc_chrdev_region(&dev, aesd_minor, 1, "aesdchar");
     aesd_major = MAJOR(dev);
     if (result < 0) {
@@ -369,7 +397,7 @@ int aesd_init_module(void)
     memset(&aesd_device, 0, sizeof(struct aesd_dev));
     
     // Initialize circular buffer
-    aesd_circular_buffer_init(&aesd_device.circular_buffer);
+    aesd_circular_buffer_init_depth(&aesd_device.circular_buffer, history_depth);
     
     // Initialize mutex
     mutex_init(&aesd_device.lock);
@@ -377,6 +405,7 @@ int aesd_init_module(void)
     // Initialize working entry
     aesd_device.working_entry.buffptr = NULL;
     aesd_device.working_entry.size = 0;
+    aesd_device.working_capacity = 0;
     
     result = aesd_setup_cdev(&aesd_device);
     
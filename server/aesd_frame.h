@@ -0,0 +1,58 @@
+/*
+ * aesd_frame.h
+ *
+ *  Length-prefixed binary protocol of aesdsocket.
+ *
+ *  A connection starts in the newline text protocol.  Sending the line
+ *  FRAME_NEGOTIATE switches it to frames for the rest of its life; the server
+ *  answers FRAME_NEGOTIATE_ACK as a text line, a server without frame support
+ *  stores the line and echoes the history instead.  Every request and every
+ *  response is a struct aesd_frame_header followed by length payload bytes,
+ *  all integers in network byte order.  Each request gets exactly one
+ *  response, in order, with the op of the request.
+ *
+ *  FRAME_APPEND      payload is written as is.  When it ends with a newline
+ *                    the packet is complete and the response carries the
+ *                    whole history, otherwise an empty payload.
+ *  FRAME_SEEK_READ   payload is a struct aesd_frame_seek, the response
+ *                    carries the history from that position.
+ *  FRAME_STATS       empty payload, the response carries the metrics text.
+ */
+
+#ifndef AESD_FRAME_H
+#define AESD_FRAME_H
+
+#include <stdint.h>
+
+#define FRAME_NEGOTIATE "AESDCHAR_BINARY"
+#define FRAME_NEGOTIATE_ACK "AESDCHAR_BINARY OK\n"
+
+// Largest request payload, a connection sending more is closed
+#define FRAME_PAYLOAD_MAX (16 * 1024 * 1024)
+
+enum frame_op {
+    FRAME_APPEND = 1,
+    FRAME_SEEK_READ = 2,
+    FRAME_STATS = 3,
+};
+
+enum frame_status {
+    FRAME_OK = 0,
+    FRAME_EINVAL = 1,       // Malformed request or rejected seek
+    FRAME_ENOTSUP = 2,      // Op unknown or not available on this backend
+    FRAME_EIO = 3,          // The device or file failed
+};
+
+struct aesd_frame_header {
+    uint8_t op;
+    uint8_t status;         // Zero in requests
+    uint16_t reserved;
+    uint32_t length;        // Payload bytes that follow
+} __attribute__((packed));
+
+struct aesd_frame_seek {
+    uint32_t write_cmd;
+    uint32_t write_cmd_offset;
+} __attribute__((packed));
+
+#endif /* AESD_FRAME_H */
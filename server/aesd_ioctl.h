@@ -38,9 +38,12 @@ struct aesd_seekto {
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+// Read the stream offset of the oldest byte still held, the number of bytes
+// evicted since the driver was loaded, to tell positions apart as the window moves
+#define AESDCHAR_IOCGBASE _IOR(AESD_IOC_MAGIC, 2, uint64_t)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 2
 
 #endif /* AESD_IOCTL_H */
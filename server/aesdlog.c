@@ -0,0 +1,257 @@
+#define _DEFAULT_SOURCE
+#include "sys/eventfd.h"
+#include "syslog.h"
+#include "unistd.h"
+#include "string.h"
+#include "stdlib.h"
+#include "stdio.h"
+#include "stdarg.h"
+#include "stdint.h"
+#include "stdbool.h"
+#include "errno.h"
+#include "pthread.h"
+#include "aesdlog.h"
+
+// Per-thread ring geometry, LOG_RING_SLOTS must be a power of two
+#define LOG_RING_SLOTS 128
+#define LOG_MSG_MAX 240
+
+struct log_entry {
+    int level;
+    char msg[LOG_MSG_MAX];
+};
+
+/**
+ * Single producer (the owning thread), single consumer (the drainer) ring.
+ * Rings are never freed while the drainer runs, a thread that exits gives
+ * its ring back for the next thread to claim once it has been drained.
+ */
+struct log_ring {
+    struct log_entry entries[LOG_RING_SLOTS];
+    unsigned head;          // Next slot the producer fills
+    unsigned tail;          // Next slot the drainer forwards
+    unsigned long dropped;  // Messages lost to a full ring
+    bool in_use;            // Owned by a live thread, protected by rings_lock
+    struct log_ring *next;
+};
+
+int aesdlog_level = LOG_INFO;
+
+static struct log_ring *rings;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static pthread_t drainer_tid;
+static int wake_fd = -1;
+static int running;
+static int stopping;
+static int drainer_idle;
+
+static void ring_release(void *arg)
+{
+    struct log_ring *ring = (struct log_ring *)arg;
+
+    pthread_mutex_lock(&rings_lock);
+    ring->in_use = false;
+    pthread_mutex_unlock(&rings_lock);
+}
+
+// Ring of the calling thread, reusing a drained one left by an exited thread
+static struct log_ring *ring_get(void)
+{
+    struct log_ring *ring = pthread_getspecific(ring_key);
+    if(ring){
+        return ring;
+    }
+
+    pthread_mutex_lock(&rings_lock);
+    for(ring = rings; ring; ring = ring->next){
+        if(!ring->in_use && ring->tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)){
+            break;
+        }
+    }
+    if(!ring){
+        ring = calloc(1, sizeof(struct log_ring));
+        if(ring){
+            ring->next = rings;
+            __atomic_store_n(&rings, ring, __ATOMIC_RELEASE);
+        }
+    }
+    if(ring){
+        ring->in_use = true;
+        pthread_setspecific(ring_key, ring);
+    }
+    pthread_mutex_unlock(&rings_lock);
+    return ring;
+}
+
+void aesdlog_write(int level, const char *fmt, ...)
+{
+    va_list ap;
+    struct log_ring *ring;
+
+    va_start(ap, fmt);
+
+    if(!__atomic_load_n(&running, __ATOMIC_ACQUIRE)){
+        vsyslog(level, fmt, ap);
+        va_end(ap);
+        return;
+    }
+
+    ring = ring_get();
+    if(!ring){
+        va_end(ap);
+        return;
+    }
+
+    unsigned head = ring->head;
+    if(head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SLOTS){
+        __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+        va_end(ap);
+        return;
+    }
+
+    struct log_entry *entry = &ring->entries[head & (LOG_RING_SLOTS - 1)];
+    entry->level = level;
+    vsnprintf(entry->msg, sizeof(entry->msg), fmt, ap);
+    va_end(ap);
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+
+    // Only pay for a wakeup when the drainer went to sleep, eventfd writes don't block
+    if(__atomic_load_n(&drainer_idle, __ATOMIC_SEQ_CST)){
+        uint64_t one = 1;
+        if(write(wake_fd, &one, sizeof(one)) == -1){
+            // Counter saturated, the drainer is awake anyway
+        }
+    }
+}
+
+// Forward everything queued, returns the number of messages handled
+static unsigned drain_rings(void)
+{
+    unsigned drained = 0;
+
+    for(struct log_ring *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring; ring = ring->next){
+        unsigned tail = ring->tail;
+        unsigned head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+        while(tail != head){
+            struct log_entry *entry = &ring->entries[tail & (LOG_RING_SLOTS - 1)];
+            syslog(entry->level, "%s", entry->msg);
+            tail++;
+            drained++;
+            __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+        }
+
+        unsigned long dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+        if(dropped){
+            syslog(LOG_WARNING, "Log ring full, dropped %lu messages", dropped);
+        }
+    }
+    return drained;
+}
+
+static bool rings_pending(void)
+{
+    for(struct log_ring *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring; ring = ring->next){
+        if(ring->tail != __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST)){
+            return true;
+        }
+    }
+    return false;
+}
+
+static void *drainer_thread_func(void *arg)
+{
+    uint64_t count;
+
+    while(true){
+        if(drain_rings() > 0){
+            continue;
+        }
+        if(__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)){
+            break;
+        }
+
+        // Announce the nap, then look once more so a racing producer isn't missed
+        __atomic_store_n(&drainer_idle, 1, __ATOMIC_SEQ_CST);
+        if(!rings_pending() && !__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)){
+            if(read(wake_fd, &count, sizeof(count)) == -1 && errno != EINTR){
+                syslog(LOG_ERR, "Log drainer wait failed: %m");
+                __atomic_store_n(&drainer_idle, 0, __ATOMIC_SEQ_CST);
+                break;
+            }
+        }
+        __atomic_store_n(&drainer_idle, 0, __ATOMIC_SEQ_CST);
+    }
+
+    drain_rings();
+    pthread_exit(NULL);
+}
+
+int aesdlog_start(void)
+{
+    if(pthread_key_create(&ring_key, ring_release) != 0){
+        syslog(LOG_ERR, "Failed to create log ring key");
+        return -1;
+    }
+
+    wake_fd = eventfd(0, EFD_CLOEXEC);
+    if(wake_fd == -1){
+        syslog(LOG_ERR, "Failed to create log wakeup eventfd: %m");
+        return -1;
+    }
+
+    __atomic_store_n(&stopping, 0, __ATOMIC_RELEASE);
+    if(pthread_create(&drainer_tid, NULL, drainer_thread_func, NULL) != 0){
+        syslog(LOG_ERR, "Failed to create log drainer thread");
+        close(wake_fd);
+        wake_fd = -1;
+        return -1;
+    }
+
+    __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void aesdlog_stop(void)
+{
+    uint64_t one = 1;
+
+    if(!__atomic_load_n(&running, __ATOMIC_ACQUIRE)){
+        return;
+    }
+
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    if(write(wake_fd, &one, sizeof(one)) == -1){
+        syslog(LOG_ERR, "Failed to wake log drainer: %m");
+    }
+    pthread_join(drainer_tid, NULL);
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+
+    close(wake_fd);
+    wake_fd = -1;
+
+    pthread_setspecific(ring_key, NULL);
+    pthread_mutex_lock(&rings_lock);
+    while(rings){
+        struct log_ring *ring = rings;
+        rings = ring->next;
+        free(ring);
+    }
+    pthread_mutex_unlock(&rings_lock);
+}
+
+int aesdlog_parse_level(const char *name)
+{
+    if(strcmp(name, "err") == 0){
+        return LOG_ERR;
+    } else if(strcmp(name, "warning") == 0){
+        return LOG_WARNING;
+    } else if(strcmp(name, "info") == 0){
+        return LOG_INFO;
+    } else if(strcmp(name, "debug") == 0){
+        return LOG_DEBUG;
+    }
+    return -1;
+}
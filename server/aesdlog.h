@@ -0,0 +1,57 @@
+/*
+ * aesdlog.h
+ *
+ *  Level gated, asynchronous logging for aesdsocket.
+ *
+ *  AESD_LOG() compiles away for levels above AESDLOG_COMPILE_LEVEL and costs a
+ *  single compare for levels above the runtime aesdlog_level, arguments are
+ *  not evaluated in either case.  Enabled messages are formatted into a ring
+ *  owned by the calling thread and forwarded to syslog by a drainer thread, so
+ *  a client thread never waits on the syslog socket.  A full ring drops the
+ *  message and counts it instead of blocking.
+ */
+
+#ifndef AESDSOCKET_AESDLOG_H
+#define AESDSOCKET_AESDLOG_H
+
+#include "syslog.h"
+
+// Highest syslog priority compiled in, LOG_INFO drops every debug message
+#ifndef AESDLOG_COMPILE_LEVEL
+#define AESDLOG_COMPILE_LEVEL LOG_DEBUG
+#endif
+
+// Highest syslog priority emitted at runtime
+extern int aesdlog_level;
+
+#define AESD_LOG(level, fmt, args...) \
+    do { \
+        if((level) <= AESDLOG_COMPILE_LEVEL && (level) <= aesdlog_level) \
+            aesdlog_write(level, fmt, ## args); \
+    } while(0)
+
+/**
+ * Queue a message for the drainer, or hand it straight to syslog while the
+ * drainer is not running.  Use through AESD_LOG().
+ */
+void aesdlog_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+ * Start the drainer thread.  Call after daemonizing, the thread does not
+ * survive a fork.  @return 0 on success, -1 if logging stays synchronous.
+ */
+int aesdlog_start(void);
+
+/**
+ * Flush every ring and stop the drainer.  Other threads must be done
+ * logging through their rings, later messages go to syslog directly.
+ */
+void aesdlog_stop(void);
+
+/**
+ * Map a level name (err, warning, info, debug) to its syslog priority.
+ * @return the priority, or -1 for an unknown name.
+ */
+int aesdlog_parse_level(const char *name);
+
+#endif /* AESDSOCKET_AESDLOG_H */
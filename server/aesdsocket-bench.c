@@ -0,0 +1,533 @@
+/*
+ * aesdsocket-bench.c
+ *
+ *  Load generator for aesdsocket.  Drives N concurrent connections, one
+ *  thread each, with packets of a configurable size, split into several
+ *  writes according to a newline ratio, and mixed with AESDCHAR_IOCSEEKTO
+ *  commands.  Reports throughput and latency percentiles for the whole run
+ *  and per operation, as text or as a JSON object.
+ *
+ *  Closed loop (default): each connection sends its next request as soon as
+ *  the previous readback is complete.
+ *  Open loop (-R rate): requests are scheduled at a fixed aggregate rate and
+ *  latency is measured from the scheduled send time, so a stalled server is
+ *  charged for the requests it delayed.
+ *
+ *  The protocol has no framing, a readback is taken as complete once it ends
+ *  at a newline and holds the request's unique token.  A seek readback has
+ *  no token and is complete once it ends at a newline and nothing more
+ *  arrives for SEEK_QUIET_MS, its latency includes that quiet window.
+ *
+ *  Usage: aesdsocket-bench [-H host] [-P port] [-c conns] [-d seconds]
+ *         [-s size|min-max] [-r newline_ratio] [-k seek_ratio] [-R rate]
+ *         [-j json_path]
+ */
+
+#define _GNU_SOURCE
+#include "sys/socket.h"
+#include "sys/types.h"
+#include "netinet/in.h"
+#include "netinet/tcp.h"
+#include "netdb.h"
+#include "unistd.h"
+#include "poll.h"
+#include "string.h"
+#include "stdlib.h"
+#include "stdio.h"
+#include "stdint.h"
+#include "stdbool.h"
+#include "errno.h"
+#include "pthread.h"
+#include "time.h"
+
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT "9000"
+#define DEFAULT_CONNS 8
+#define DEFAULT_SECONDS 10
+#define DEFAULT_SIZE 64
+#define SEEK_COMMAND "AESDCHAR_IOCSEEKTO:0,0\n"
+#define SEEK_QUIET_MS 1
+#define RECV_CHUNK (64 * 1024)
+
+enum op_kind {
+    OP_WRITE,
+    OP_SEEK,
+    OP_KINDS,
+};
+
+static const char *op_names[OP_KINDS] = { "write", "seek" };
+
+struct bench_config {
+    const char *host;
+    const char *port;
+    int conns;
+    double seconds;
+    size_t size_min;
+    size_t size_max;
+    double newline_ratio;
+    double seek_ratio;
+    double rate;            // Aggregate requests per second, 0 for closed loop
+    const char *json_path;
+};
+
+// Latency samples in microseconds, grown as needed
+struct samples {
+    double *values;
+    size_t count;
+    size_t cap;
+};
+
+struct client {
+    int id;
+    const struct bench_config *cfg;
+    pthread_t thread_id;
+    int fd;
+    uint64_t rng;
+
+    struct samples latency[OP_KINDS];
+    uint64_t writes;        // write() calls, partial ones included
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    uint64_t errors;
+
+    char *rx_buf;
+    size_t rx_cap;
+};
+
+static pthread_barrier_t start_barrier;
+static struct timespec start_time;
+
+static double ts_diff(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void ts_add(struct timespec *ts, double seconds)
+{
+    long ns = ts->tv_nsec + (long)((seconds - (long)seconds) * 1e9);
+    ts->tv_sec += (long)seconds + ns / 1000000000L;
+    ts->tv_nsec = ns % 1000000000L;
+}
+
+// xorshift64*, one state per client
+static uint64_t rng_next(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ULL;
+}
+
+static double rng_unit(uint64_t *state)
+{
+    return (rng_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void samples_add(struct samples *s, double value)
+{
+    if(s->count == s->cap){
+        s->cap = s->cap ? s->cap * 2 : 1024;
+        s->values = realloc(s->values, s->cap * sizeof(double));
+        if(!s->values){
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    s->values[s->count++] = value;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest rank percentile of sorted samples
+static double percentile(const struct samples *s, double p)
+{
+    if(s->count == 0){
+        return 0;
+    }
+    size_t rank = (size_t)(p / 100.0 * s->count + 0.5);
+    if(rank < 1){
+        rank = 1;
+    }
+    if(rank > s->count){
+        rank = s->count;
+    }
+    return s->values[rank - 1];
+}
+
+static int connect_to(const char *host, const char *port)
+{
+    struct addrinfo hints, *res;
+    int one = 1;
+    int fd = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int status = getaddrinfo(host, port, &hints, &res);
+    if(status != 0){
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
+        return -1;
+    }
+    fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if(fd != -1 && connect(fd, res->ai_addr, res->ai_addrlen) == -1){
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if(fd != -1){
+        // Each request is one small write, don't let Nagle batch them
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+static int send_all(struct client *c, const char *data, size_t len)
+{
+    while(len > 0){
+        ssize_t sent = send(c->fd, data, len, MSG_NOSIGNAL);
+        if(sent == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        data += sent;
+        len -= sent;
+        c->bytes_sent += sent;
+    }
+    c->writes++;
+    return 0;
+}
+
+/**
+ * Read one readback.  With @param token it is complete once it ends at a
+ * newline and holds the token, without one once it ends at a newline and the
+ * socket stays quiet for SEEK_QUIET_MS.  @return 0, or -1 if the connection
+ * failed or closed.
+ */
+static int recv_readback(struct client *c, const char *token, size_t token_len)
+{
+    size_t len = 0;
+    size_t searched = 0;
+
+    while(true){
+        if(len + RECV_CHUNK > c->rx_cap){
+            c->rx_cap = (len + RECV_CHUNK) * 2;
+            c->rx_buf = realloc(c->rx_buf, c->rx_cap);
+            if(!c->rx_buf){
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        ssize_t got = recv(c->fd, c->rx_buf + len, c->rx_cap - len, 0);
+        if(got <= 0){
+            if(got == -1 && errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        len += got;
+        c->bytes_received += got;
+
+        if(c->rx_buf[len - 1] != '\n'){
+            continue;
+        }
+        if(token){
+            // Only look at what arrived since the last search, plus an overlap
+            size_t from = searched > token_len ? searched - token_len : 0;
+            if(memmem(c->rx_buf + from, len - from, token, token_len)){
+                return 0;
+            }
+            searched = len;
+        } else {
+            struct pollfd pfd = { .fd = c->fd, .events = POLLIN };
+            if(poll(&pfd, 1, SEEK_QUIET_MS) == 0){
+                return 0;
+            }
+        }
+    }
+}
+
+/**
+ * Send one packet of the configured size, split into writes so that a
+ * fraction newline_ratio of them end it, and wait for its readback.
+ * @return 0 on success, -1 on a connection failure.
+ */
+static int do_write(struct client *c, uint64_t seq)
+{
+    const struct bench_config *cfg = c->cfg;
+    char token[48];
+    int token_len = snprintf(token, sizeof(token), "b%d-%llu:", c->id, (unsigned long long)seq);
+    size_t size = cfg->size_min;
+    if(cfg->size_max > cfg->size_min){
+        size += rng_next(&c->rng) % (cfg->size_max - cfg->size_min + 1);
+    }
+    if(size < (size_t)token_len + 1){
+        size = token_len + 1;
+    }
+
+    char *chunk = malloc(size);
+    if(!chunk){
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    memset(chunk, 'x', size);
+    memcpy(chunk, token, token_len);
+
+    // Unterminated chunks first, the server keeps them as a partial packet
+    while(rng_unit(&c->rng) >= cfg->newline_ratio){
+        if(send_all(c, chunk, size) == -1){
+            free(chunk);
+            return -1;
+        }
+        memset(chunk, 'x', token_len);
+    }
+    memcpy(chunk, token, token_len);
+    chunk[size - 1] = '\n';
+    int rc = send_all(c, chunk, size);
+    free(chunk);
+    if(rc == -1){
+        return -1;
+    }
+    return recv_readback(c, token, token_len);
+}
+
+static int do_seek(struct client *c)
+{
+    if(send_all(c, SEEK_COMMAND, strlen(SEEK_COMMAND)) == -1){
+        return -1;
+    }
+    return recv_readback(c, NULL, 0);
+}
+
+static void *client_thread_func(void *arg)
+{
+    struct client *c = (struct client *)arg;
+    const struct bench_config *cfg = c->cfg;
+    struct timespec deadline, next, now, begin;
+    double interval = cfg->rate > 0 ? cfg->conns / cfg->rate : 0;
+    uint64_t seq = 0;
+
+    pthread_barrier_wait(&start_barrier);
+    deadline = start_time;
+    ts_add(&deadline, cfg->seconds);
+    // Spread the open loop schedules of the connections over one interval
+    next = start_time;
+    ts_add(&next, interval * c->id / cfg->conns);
+
+    while(true){
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if(ts_diff(&now, &deadline) <= 0){
+            break;
+        }
+
+        if(interval > 0){
+            if(ts_diff(&next, &deadline) <= 0){
+                break;
+            }
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+            begin = next;
+            ts_add(&next, interval);
+        } else {
+            begin = now;
+        }
+
+        // The first request writes, so a seek always has history to land on
+        enum op_kind kind = seq > 0 && rng_unit(&c->rng) < cfg->seek_ratio ? OP_SEEK : OP_WRITE;
+        int rc = kind == OP_SEEK ? do_seek(c) : do_write(c, seq);
+        if(rc == -1){
+            c->errors++;
+            break;
+        }
+        seq++;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        samples_add(&c->latency[kind], ts_diff(&begin, &now) * 1e6);
+    }
+
+    pthread_exit(NULL);
+}
+
+static void print_json(FILE *out, const struct bench_config *cfg, double elapsed,
+                       struct samples *all, struct samples *per_op,
+                       uint64_t writes, uint64_t sent, uint64_t received, uint64_t errors)
+{
+    fprintf(out, "{\"host\":\"%s\",\"port\":\"%s\",\"conns\":%d,\"seconds\":%.3f,"
+            "\"size_min\":%zu,\"size_max\":%zu,\"newline_ratio\":%.3f,\"seek_ratio\":%.3f,"
+            "\"mode\":\"%s\",\"rate\":%.1f,",
+            cfg->host, cfg->port, cfg->conns, elapsed, cfg->size_min, cfg->size_max,
+            cfg->newline_ratio, cfg->seek_ratio, cfg->rate > 0 ? "open" : "closed", cfg->rate);
+    fprintf(out, "\"requests\":%zu,\"requests_per_sec\":%.1f,\"writes\":%llu,"
+            "\"bytes_sent\":%llu,\"bytes_received\":%llu,\"errors\":%llu,",
+            all->count, all->count / elapsed, (unsigned long long)writes,
+            (unsigned long long)sent, (unsigned long long)received, (unsigned long long)errors);
+    fprintf(out, "\"latency_us\":{\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}",
+            percentile(all, 50), percentile(all, 99), percentile(all, 99.9), percentile(all, 100));
+    for(int k = 0; k < OP_KINDS; k++){
+        fprintf(out, ",\"%s\":{\"requests\":%zu,\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}",
+                op_names[k], per_op[k].count, percentile(&per_op[k], 50), percentile(&per_op[k], 99),
+                percentile(&per_op[k], 99.9), percentile(&per_op[k], 100));
+    }
+    fprintf(out, "}\n");
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-H host] [-P port] [-c conns] [-d seconds] [-s size|min-max]"
+            " [-r newline_ratio] [-k seek_ratio] [-R rate] [-j json_path]\n", name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench_config cfg = {
+        .host = DEFAULT_HOST,
+        .port = DEFAULT_PORT,
+        .conns = DEFAULT_CONNS,
+        .seconds = DEFAULT_SECONDS,
+        .size_min = DEFAULT_SIZE,
+        .size_max = DEFAULT_SIZE,
+        .newline_ratio = 1.0,
+        .seek_ratio = 0.0,
+        .rate = 0,
+        .json_path = NULL,
+    };
+    int opt;
+
+    while((opt = getopt(argc, argv, "H:P:c:d:s:r:k:R:j:")) != -1){
+        switch(opt){
+            case 'H':
+                cfg.host = optarg;
+                break;
+            case 'P':
+                cfg.port = optarg;
+                break;
+            case 'c':
+                cfg.conns = atoi(optarg);
+                break;
+            case 'd':
+                cfg.seconds = atof(optarg);
+                break;
+            case 's':
+                if(sscanf(optarg, "%zu-%zu", &cfg.size_min, &cfg.size_max) == 1){
+                    cfg.size_max = cfg.size_min;
+                }
+                break;
+            case 'r':
+                cfg.newline_ratio = atof(optarg);
+                break;
+            case 'k':
+                cfg.seek_ratio = atof(optarg);
+                break;
+            case 'R':
+                cfg.rate = atof(optarg);
+                break;
+            case 'j':
+                cfg.json_path = optarg;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if(cfg.conns < 1 || cfg.seconds <= 0 || cfg.size_min < 1 || cfg.size_max < cfg.size_min ||
+       cfg.newline_ratio <= 0 || cfg.newline_ratio > 1 || cfg.seek_ratio < 0 || cfg.seek_ratio > 1 ||
+       cfg.rate < 0){
+        usage(argv[0]);
+    }
+
+    struct client *clients = calloc(cfg.conns, sizeof(struct client));
+    if(!clients){
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    pthread_barrier_init(&start_barrier, NULL, cfg.conns + 1);
+
+    for(int i = 0; i < cfg.conns; i++){
+        struct client *c = &clients[i];
+        c->id = i;
+        c->cfg = &cfg;
+        c->rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+        c->fd = connect_to(cfg.host, cfg.port);
+        if(c->fd == -1){
+            fprintf(stderr, "connect %s:%s failed: %s\n", cfg.host, cfg.port, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if(pthread_create(&c->thread_id, NULL, client_thread_func, c) != 0){
+            perror("pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    pthread_barrier_wait(&start_barrier);
+
+    struct samples all = { 0 };
+    struct samples per_op[OP_KINDS] = { { 0 } };
+    uint64_t writes = 0, sent = 0, received = 0, errors = 0;
+
+    for(int i = 0; i < cfg.conns; i++){
+        struct client *c = &clients[i];
+        pthread_join(c->thread_id, NULL);
+        close(c->fd);
+        for(int k = 0; k < OP_KINDS; k++){
+            for(size_t j = 0; j < c->latency[k].count; j++){
+                samples_add(&all, c->latency[k].values[j]);
+                samples_add(&per_op[k], c->latency[k].values[j]);
+            }
+            free(c->latency[k].values);
+        }
+        writes += c->writes;
+        sent += c->bytes_sent;
+        received += c->bytes_received;
+        errors += c->errors;
+        free(c->rx_buf);
+    }
+
+    struct timespec end_time;
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    double elapsed = ts_diff(&start_time, &end_time);
+
+    qsort(all.values, all.count, sizeof(double), cmp_double);
+    for(int k = 0; k < OP_KINDS; k++){
+        qsort(per_op[k].values, per_op[k].count, sizeof(double), cmp_double);
+    }
+
+    printf("%d connections, %.1f s, %s loop%s\n", cfg.conns, elapsed,
+           cfg.rate > 0 ? "open" : "closed", errors ? ", with connection errors" : "");
+    printf("requests %zu (%.1f/s), writes %llu, sent %.1f MB, received %.1f MB (%.1f MB/s)\n",
+           all.count, all.count / elapsed, (unsigned long long)writes,
+           sent / 1e6, received / 1e6, received / 1e6 / elapsed);
+    printf("%-8s %10s %10s %10s %10s %10s\n", "op", "requests", "p50_us", "p99_us", "p999_us", "max_us");
+    printf("%-8s %10zu %10.1f %10.1f %10.1f %10.1f\n", "all", all.count, percentile(&all, 50),
+           percentile(&all, 99), percentile(&all, 99.9), percentile(&all, 100));
+    for(int k = 0; k < OP_KINDS; k++){
+        printf("%-8s %10zu %10.1f %10.1f %10.1f %10.1f\n", op_names[k], per_op[k].count,
+               percentile(&per_op[k], 50), percentile(&per_op[k], 99),
+               percentile(&per_op[k], 99.9), percentile(&per_op[k], 100));
+    }
+
+    if(cfg.json_path){
+        FILE *out = strcmp(cfg.json_path, "-") == 0 ? stdout : fopen(cfg.json_path, "w");
+        if(!out){
+            perror("fopen");
+            exit(EXIT_FAILURE);
+        }
+        print_json(out, &cfg, elapsed, &all, per_op, writes, sent, received, errors);
+        if(out != stdout){
+            fclose(out);
+        }
+    }
+
+    free(all.values);
+    for(int k = 0; k < OP_KINDS; k++){
+        free(per_op[k].values);
+    }
+    free(clients);
+    pthread_barrier_destroy(&start_barrier);
+    return errors ? EXIT_FAILURE : 0;
+}
@@ -1,6 +1,8 @@
-#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
 #define _POSIX_C_SOURCE 200112L
 #include "sys/socket.h"
+#include "sys/un.h"
+#include "sys/stat.h"
 #include "sys/types.h"
 #include "netdb.h"
 #include "syslog.h"
@@ -13,32 +15,37 @@
 #include "arpa/inet.h"
 #include "errno.h"
 #include "stdbool.h"
+#include "limits.h"
 #include "pthread.h"
 #include "queue.h"
 #include "time.h"
 #include "sys/ioctl.h"
 #include "aesd_ioctl.h"
+#include "sys/resource.h"
+#include "sys/eventfd.h"
+#include "sys/timerfd.h"
+#include "poll.h"
+#include "stdint.h"
+#include "aesdsocket.h"
+#include "connection.h"
+#include "event_loop.h"
+#include "worker_pool.h"
+#include "uring_io.h"
+#include "group_commit.h"
+#include "mmap_log.h"
+#include "readback_cache.h"
+#include "fanout.h"
+#include "metrics.h"
+#include "aesdlog.h"
 
-#define USE_AESD_CHAR_DEVICE 1
-#define BACKLOG 10
-#define PORT "9000"
-#define BUFFER_SIZE 1024
-#define TIMESTAMP_INTERVAL 10
-
-// Add the build switch for char device
-#ifdef USE_AESD_CHAR_DEVICE
-#define OUTPUT_FILE "/dev/aesdchar"
-#else
-#define OUTPUT_FILE "/var/tmp/aesdsocketdata"
-#endif
 
 // Global vars for thread managment
 volatile sig_atomic_t exit_flag = 0;
-#ifdef USE_AESD_CHAR_DEVICE
-// No file mutex needed for char device - driver handles locking
-#else
+int shutdown_fd = -1;
+enum io_backend io_backend = IO_SYNC;
+// When the shutdown signal arrived, to report how long winding down took
+static struct timespec shutdown_start;
 pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
-#endif
 
 //Thread data structure for linked list
 struct thread_data {
@@ -50,297 +57,718 @@ struct thread_data {
 
 // Linked list head
 SLIST_HEAD(thread_list, thread_data);
-struct thread_list head = SLIST_HEAD_INITIALIZER(head);
+
+// How accepted connections are served
+enum serve_mode {
+    MODE_THREAD,    // One thread per connection (default)
+    MODE_EPOLL,     // Fixed set of epoll event loop threads
+    MODE_POOL,      // Fixed set of blocking workers fed by a bounded queue
+};
+
+// What to do with a new connection at the connection limit
+enum admit_policy {
+    ADMIT_PAUSE,    // Hold it and stop accepting until a slot frees up
+    ADMIT_REJECT,   // Send ADMIT_BUSY_LINE and close it
+};
+
+// One listening socket and the loop accepting from it.  With several
+// acceptors each owns a SO_REUSEPORT socket on PORT and the kernel spreads
+// incoming connections across them.
+struct acceptor {
+    int sockfd;
+    int cpu;                    // Core the acceptor is pinned to, -1 if not
+    enum serve_mode mode;
+    pthread_t thread_id;
+    struct thread_list threads; // Client threads started in thread mode
+};
+
+#define DEFAULT_QUEUE_DEPTH 64
+
+// Sent to a client turned away by ADMIT_REJECT
+#define ADMIT_BUSY_LINE "ERROR: server busy, try again later\n"
+
+static enum admit_policy admit_policy = ADMIT_PAUSE;
+
+// Metrics are only served locally
+#define METRICS_HOST "127.0.0.1"
+// How long a metrics scrape may take to send its request and take the reply
+#define METRICS_TIMEOUT_MS 1000
 
 // Func prototypes
 void *client_thread_func(void *arg);
 void *timestamp_thread_func(void *arg);
+void *acceptor_thread_func(void *arg);
+void *metrics_thread_func(void *arg);
+
+void server_shutdown(void)
+{
+    uint64_t one = 1;
 
-void signal_handler(int signum) {
     exit_flag = 1;
+    if(write(shutdown_fd, &one, sizeof(one)) == -1){
+        // Already signalled, the counter only has to be non-zero
+    }
+}
+
+void signal_handler(int signum) {
+    clock_gettime(CLOCK_MONOTONIC, &shutdown_start);
+    server_shutdown();
+}
+
+/**
+ * Block until @param fd is readable or shutdown starts.
+ * @return true if @param fd is readable, false once shutting down.
+ */
+static bool wait_readable(int fd)
+{
+    struct pollfd fds[2] = {
+        { .fd = fd, .events = POLLIN },
+        { .fd = shutdown_fd, .events = POLLIN },
+    };
+
+    while(!exit_flag){
+        if(poll(fds, 2, -1) == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            AESD_LOG(LOG_ERR, "poll failed: %m");
+            return false;
+        }
+        if(fds[1].revents){
+            return false;
+        }
+        if(fds[0].revents){
+            return true;
+        }
+    }
+    return false;
 }
 
 // Client thread function
 void *client_thread_func(void *arg){
     struct thread_data *tdata = (struct thread_data *)arg;
-    int client_fd = tdata->socket_fd;
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_received;
-    int data_fd = -1;
-    bool use_seek_command = false;
-    unsigned int write_cmd = 0, write_cmd_offset = 0;
+    struct aesd_conn conn;
 
-#ifdef USE_AESD_CHAR_DEVICE
-    // Open char device once per connection and keep it open
-    data_fd = open(OUTPUT_FILE, O_RDWR);
-    if(data_fd == -1){
-        syslog(LOG_ERR, "Failed to open char device");
+    if(conn_open(&conn, tdata->socket_fd, false) == -1){
         tdata->thread_complete = true;
-        close(client_fd);
+        conn_drop(tdata->socket_fd);
         pthread_exit(NULL);
     }
-    syslog(LOG_DEBUG, "Opened char device fd: %d", data_fd);
-#else
-    // Open file to enter data (original implementation)
-    data_fd = open(OUTPUT_FILE, O_CREAT | O_APPEND | O_RDWR, 0644);
-    if(data_fd == -1){
-        syslog(LOG_ERR, "Failed to open data file");
-        tdata->thread_complete = true;
-        close(client_fd);
+
+    conn_serve(&conn);
+
+    // Cleanup
+    conn_close(&conn);
+
+    tdata->thread_complete = true;
+    AESD_LOG(LOG_DEBUG, "Client thread completed");
+
+    pthread_exit(NULL);
+}
+
+#ifndef USE_AESD_CHAR_DEVICE
+// Timestamp thread function - Not needed for CHAR device
+void *timestamp_thread_func(void *arg) {
+    int data_fd;
+    uint64_t expirations;
+    struct itimerspec interval = {
+        .it_interval = { .tv_sec = TIMESTAMP_INTERVAL },
+        .it_value = { .tv_sec = TIMESTAMP_INTERVAL },
+    };
+
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if(timer_fd == -1 || timerfd_settime(timer_fd, 0, &interval, NULL) == -1){
+        AESD_LOG(LOG_ERR, "Failed to arm timestamp timer: %m");
+        if(timer_fd != -1){
+            close(timer_fd);
+        }
         pthread_exit(NULL);
     }
-#endif
 
-    // Receive data from client
-    while((bytes_received = recv(client_fd, buffer, BUFFER_SIZE - 1, 0)) > 0){
-        buffer[bytes_received] = '\0';
-        syslog(LOG_DEBUG, "Received %zd bytes: %s", bytes_received, buffer);
-
-        // Check if this is a seek command
-        use_seek_command = false;
-        if(bytes_received >= 18 && strncmp(buffer, "AESDCHAR_IOCSEEKTO:", 18) == 0){
-            // Remove any trailing newline or whitespace before parsing
-            char *seek_buffer = buffer;
-            size_t seek_len = bytes_received;
-            
-            // Trim trailing whitespace/newline
-            while (seek_len > 0 && (seek_buffer[seek_len-1] == '\n' || 
-                                    seek_buffer[seek_len-1] == '\r' || 
-                                    seek_buffer[seek_len-1] == ' ')) {
-                seek_buffer[--seek_len] = '\0';
-            }
-            
-            // Parse this seek command
-            if(sscanf(seek_buffer + 19, "%u,%u", &write_cmd, &write_cmd_offset) == 2){
-                syslog(LOG_DEBUG, "Processing seek command: cmd=%u, offset=%u",
-                    write_cmd, write_cmd_offset);
-                use_seek_command = true;
-            } else {
-                // Debug: print the exact string we're trying to parse
-                syslog(LOG_ERR, "Failed to parse seek command: '%s' (length: %zu)", 
-                    seek_buffer + 18, strlen(seek_buffer + 18));
-                syslog(LOG_ERR, "Full buffer: '%s'", buffer);
-            }
+    // Sleeps until the timer fires or shutdown starts, nothing in between
+    while(wait_readable(timer_fd)){
+        if(read(timer_fd, &expirations, sizeof(expirations)) == -1){
+            continue;
         }
 
-#ifdef USE_AESD_CHAR_DEVICE
-        // CHAR DEVICE IMPLEMENTATION
-
-        if(use_seek_command){
-            syslog(LOG_DEBUG, "=== SEEK COMMAND DETECTED ===");
-            
-            // Prepare and send ioctl command
-            struct aesd_seekto seekto;
-            seekto.write_cmd = write_cmd;
-            seekto.write_cmd_offset = write_cmd_offset;
-
-            syslog(LOG_DEBUG, "Sending ioctl: write_cmd=%u, write_cmd_offset=%u", 
-                   write_cmd, write_cmd_offset);
-            
-            if(ioctl(data_fd, AESDCHAR_IOCSEEKTO, &seekto) == -1){
-                syslog(LOG_ERR, "ioctl seek failed: %m");
-                // Don't break - continue processing
-                continue;
-            }
+        //Generate timestamp
+        time_t now = time(NULL);
+        struct tm *timeinfo = localtime(&now);
+        char timestamp[100];
+        strftime(timestamp, sizeof(timestamp), "timestamp:%a, %d %b %Y %T %z\n", timeinfo);
 
-            syslog(LOG_DEBUG, "ioctl seek successful, reading from current position");
+        if(mmap_log_active()){
+            mmap_log_append(timestamp, strlen(timestamp));
+            continue;
+        }
 
-            // Read content back from char device and send to client
-            // Use the same fd to ensure f_pos is maintained
-            char file_buffer[BUFFER_SIZE];
-            ssize_t bytes_read;
-            ssize_t total_sent = 0;
+        // Open data file
+        data_fd = open(OUTPUT_FILE, O_CREAT | O_APPEND | O_RDWR, 0644);
 
-            // Read from current position (set by ioctl)
-            while((bytes_read = read(data_fd, file_buffer, BUFFER_SIZE)) > 0){
-                ssize_t sent = send(client_fd, file_buffer, bytes_read, 0);
-                if(sent == -1){
-                    syslog(LOG_ERR, "Failed to send data to client");
-                    break;
-                }
-                total_sent += sent;
-                syslog(LOG_DEBUG, "Sent %zd bytes to client", sent);
-            }
-            syslog(LOG_DEBUG, "Finished sending seek response, total %zd bytes", total_sent);
+        if(data_fd == -1){
+            AESD_LOG(LOG_ERR, "Failed to open data file for timestamp");
+            continue;
+        }
 
+        // Lock mutex and write timestamp, pushed to subscribers in file order
+        size_t len = strlen(timestamp);
+        pthread_mutex_lock(&file_mutex);
+        if(write(data_fd, timestamp, len) == (ssize_t)len){
+            fanout_publish(timestamp, len);
         } else {
-            // NORMAL CHAR DEVICE WRITE IMPLEMENTATION
-            
-            syslog(LOG_DEBUG, "Normal write operation");
+            AESD_LOG(LOG_ERR, "Failed to write timestamp: %m");
+        }
+        pthread_mutex_unlock(&file_mutex);
+
+        close(data_fd);
+    }
+
+    close(timer_fd);
+    pthread_exit(NULL);
+}
+#endif
+
+/**
+ * Take a connection slot for the accepted @param client_fd, applying the
+ * admission policy when the limit is reached.  While paused, further
+ * connections wait in the listen backlog.
+ * @return true if admitted, false if the socket was turned away and closed.
+ */
+static bool admit_connection(int client_fd)
+{
+    uint64_t count;
+
+    if(conn_admit()){
+        return true;
+    }
+
+    if(admit_policy == ADMIT_REJECT){
+        AESD_LOG(LOG_DEBUG, "Connection limit reached, rejecting connection");
+        metrics_inc(METRIC_ADMIT_REJECTED);
+        // Best effort, a fresh socket has room for one line
+        send(client_fd, ADMIT_BUSY_LINE, strlen(ADMIT_BUSY_LINE), MSG_DONTWAIT | MSG_NOSIGNAL);
+        close(client_fd);
+        return false;
+    }
+
+    AESD_LOG(LOG_DEBUG, "Connection limit reached, pausing accept");
+    metrics_inc(METRIC_ADMIT_PAUSED);
+    do {
+        if(!wait_readable(conn_admit_fd())){
+            close(client_fd);
+            return false;
+        }
+        if(read(conn_admit_fd(), &count, sizeof(count)) == -1){
+            // Another acceptor consumed the wakeup, retry the slot anyway
+        }
+    } while(!conn_admit());
+    return true;
+}
+
+// Accept connections on @param acc until exit_flag is set
+static void accept_loop(struct acceptor *acc)
+{
+    while(wait_readable(acc->sockfd)) {
+        struct sockaddr_storage client_addr;
+        socklen_t addr_len = sizeof(client_addr);
+        char client_ip[INET6_ADDRSTRLEN];
+        int client_fd;
 
-            // Write data to char device
-            if(write(data_fd, buffer, bytes_received) == -1){
-                syslog(LOG_ERR, "Failed to write to char device");
+        // Accept connection
+        client_fd = accept(acc->sockfd, (struct sockaddr *)&client_addr, &addr_len);
+        if (client_fd == -1) {
+            // ADD DEBUG LOGGING:
+            AESD_LOG(LOG_DEBUG, "accept failed. errno: %d, exit_flag: %d", errno, exit_flag);
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                // The connection went away before we got to it
+                continue;
+            }
+            if (exit_flag) {
+                AESD_LOG(LOG_DEBUG, "Breaking loop due to exit_flag"); // ADD THIS
                 break;
             }
-            syslog(LOG_DEBUG, "Wrote %zd bytes to char device", bytes_received);
-
-            // Check if packet is complete and ends with newline
-            if(memchr(buffer, '\n', bytes_received) != NULL){
-                syslog(LOG_DEBUG, "Packet complete, reading back all content");
-                
-                // Save current position
-                off_t current_pos = lseek(data_fd, 0, SEEK_CUR);
-                
-                // Read back ALL content from the beginning for normal writes
-                lseek(data_fd, 0, SEEK_SET);
-                
-                char file_buffer[BUFFER_SIZE];
-                ssize_t bytes_read;
-                ssize_t total_sent = 0;
-
-                while((bytes_read = read(data_fd, file_buffer, BUFFER_SIZE)) > 0){
-                    ssize_t sent = send(client_fd, file_buffer, bytes_read, 0);
-                    if(sent == -1){
-                        syslog(LOG_ERR, "Failed to send data to client");
-                        break;
-                    }
-                    total_sent += sent;
+            if (errno == EINTR) {
+                AESD_LOG(LOG_DEBUG, "accept was interrupted by a signal"); // ADD THIS
+                if (exit_flag) {
+                    break;
                 }
-                
-                // Restore position
-                lseek(data_fd, current_pos, SEEK_SET);
-                syslog(LOG_DEBUG, "Sent %zd bytes back to client", total_sent);
+                continue;
             }
+            AESD_LOG(LOG_ERR, "accept failed: %m");
+            continue;
         }
 
-#else
-        // FILE-BASED IMPLEMENTATION
+        // Get client IP address
+        if(client_addr.ss_family == AF_INET) {
+            struct sockaddr_in *s = (struct sockaddr_in *)&client_addr;
+            inet_ntop(AF_INET, &s->sin_addr, client_ip, sizeof(client_ip));
+        } else if(client_addr.ss_family == AF_INET6){
+            struct sockaddr_in6 *s = (struct sockaddr_in6 *)&client_addr;
+            inet_ntop(AF_INET6, &s->sin6_addr, client_ip, sizeof(client_ip));
+        } else {
+            strcpy(client_ip, "unix socket");
+        }
 
-        if(use_seek_command){
-            syslog(LOG_WARNING, "Seek command received but not supported in file mode");
+        AESD_LOG(LOG_INFO, "Accepted connection from %s", client_ip);
+        metrics_inc(METRIC_CONN_ACCEPTED);
+
+        if(!admit_connection(client_fd)){
+            continue;
         }
-        
-        // Lock mutex for file writing
-        pthread_mutex_lock(&file_mutex);
 
-        //Write data that's receive to the file
-        if(write(data_fd, buffer, bytes_received) == -1){
-            syslog(LOG_ERR, "Failed to write to data file");
-            pthread_mutex_unlock(&file_mutex);
-            break;
+        if(acc->mode == MODE_EPOLL){
+            event_loops_dispatch(client_fd);
+            continue;
+        }
+        if(acc->mode == MODE_POOL){
+            worker_pool_submit(client_fd);
+            continue;
+        }
+
+        // Create new thread data structure
+        struct thread_data *tdata = malloc(sizeof(struct thread_data));
+        if(!tdata){
+            AESD_LOG(LOG_ERR, "Failed to allocate thread data");
+            conn_drop(client_fd);
+            continue;
         }
 
-        // Check if packet is complete (ends with newline)
-        if(memchr(buffer, '\n', bytes_received) != NULL){
-            // Send entire file content back to client
-            lseek(data_fd, 0, SEEK_SET);
+        tdata->socket_fd = client_fd;
+        tdata->thread_complete = false;
 
-            char file_buffer[BUFFER_SIZE];
-            ssize_t bytes_read;
-            ssize_t total_sent = 0;
+        // Insert into linked list
+        SLIST_INSERT_HEAD(&acc->threads, tdata, entries);
 
-            while((bytes_read = read(data_fd, file_buffer, BUFFER_SIZE)) > 0){
-                ssize_t sent = send(client_fd, file_buffer, bytes_read, 0);
-                if(sent == -1){
-                    syslog(LOG_ERR, "Failed to send data to client");
-                    break;
-                }
-                total_sent += sent;
+        // Create client thread;
+        if(pthread_create(&tdata->thread_id, NULL, client_thread_func, tdata) != 0){
+            AESD_LOG(LOG_ERR, "Failed to create client thread");
+            SLIST_REMOVE(&acc->threads, tdata, thread_data, entries);
+            free(tdata);
+            conn_drop(client_fd);
+            continue;
+        }
+
+
+        // Clean up completed threads
+        struct thread_data *tdata_temp, *tdata_iter;
+        SLIST_FOREACH_SAFE(tdata_iter, &acc->threads, entries, tdata_temp) {
+            if(tdata_iter->thread_complete){
+                pthread_join(tdata_iter->thread_id, NULL);
+                SLIST_REMOVE(&acc->threads, tdata_iter, thread_data, entries);
+                free(tdata_iter);
             }
         }
+    }
+}
 
-        pthread_mutex_unlock(&file_mutex);
-#endif
+void *acceptor_thread_func(void *arg){
+    struct acceptor *acc = (struct acceptor *)arg;
 
-        // If newline was found in a normal write, this packet is complete
-        // Don't break for seek commands or multiple packets
-        if(!use_seek_command && memchr(buffer, '\n', bytes_received) != NULL){
-            // For normal writes ending with newline, we've already sent response
-            // Continue to receive more commands on same connection
-            syslog(LOG_DEBUG, "Normal write complete, waiting for next command");
+    if(acc->cpu >= 0){
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(acc->cpu, &cpus);
+        // Thread mode clients inherit the mask and stay on the acceptor's core
+        if(pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0){
+            AESD_LOG(LOG_WARNING, "Failed to pin acceptor to cpu %d", acc->cpu);
         }
     }
 
-    if(bytes_received == -1){
-        syslog(LOG_ERR, "recv failed: %m");
-    } else if(bytes_received == 0){
-        syslog(LOG_DEBUG, "Client disconnected");
+    accept_loop(acc);
+    pthread_exit(NULL);
+}
+
+// Answer one scrape on @param client_fd with the metrics as an HTTP response
+static void metrics_respond(int client_fd)
+{
+    struct pollfd pfd = { .fd = client_fd, .events = POLLIN };
+    struct timeval timeout = { .tv_sec = METRICS_TIMEOUT_MS / 1000 };
+    char request[BUFFER_SIZE];
+    char header[128];
+    size_t len;
+
+    // Whatever the request asks for, it gets the metrics, read it so closing
+    // the socket doesn't reset the reply
+    if(poll(&pfd, 1, METRICS_TIMEOUT_MS) > 0 &&
+       recv(client_fd, request, sizeof(request), MSG_DONTWAIT) == -1){
+        return;
     }
 
-    // Cleanup
-    close(client_fd);
-    if(data_fd != -1) {
-        close(data_fd);
-        syslog(LOG_DEBUG, "Closed char device fd: %d", data_fd);
+    char *text = metrics_render(&len);
+    if(!text){
+        return;
     }
-    
-    tdata->thread_complete = true;
-    syslog(LOG_DEBUG, "Client thread completed");
+    int header_len = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\n"
+                              "Content-Type: text/plain; version=0.0.4\r\n"
+                              "Content-Length: %zu\r\n\r\n", len);
+
+    // A scraper that stops reading must not hold the thread
+    setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if(send(client_fd, header, header_len, MSG_NOSIGNAL) == header_len){
+        send(client_fd, text, len, MSG_NOSIGNAL);
+    }
+    shutdown(client_fd, SHUT_WR);
+    free(text);
+}
 
+// Serve scrapes on the metrics listener @param arg until shutdown
+void *metrics_thread_func(void *arg){
+    int sockfd = *(int *)arg;
+
+    while(wait_readable(sockfd)){
+        int client_fd = accept(sockfd, NULL, NULL);
+        if(client_fd == -1){
+            continue;
+        }
+        metrics_respond(client_fd);
+        close(client_fd);
+    }
     pthread_exit(NULL);
 }
 
-// Timestamp thread function - Not needed for CHAR device
-void *timestamp_thread_func(void *arg) {
-#ifdef USE_AESD_CHAR_DEVICE
-    // No timestamp functionality for char device implementation
-    while(!exit_flag){
-        sleep(1);
+/**
+ * Create a socket for @param ai, shared through SO_REUSEPORT when
+ * @param reuseport is set, and bind it.
+ * @return the socket, or -1 after logging the failure.
+ */
+static int listener_open(const struct addrinfo *ai, bool reuseport)
+{
+    int yes = 1;
+    int sockfd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (sockfd == -1) {
+        AESD_LOG(LOG_ERR, "socket creation failed");
+        return -1;
     }
-#else
-    int data_fd;
 
-    while(!exit_flag){
-        sleep(1);
+    // Set SO_REUSEADDR option to avoid "Address already in use" errors
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
+        AESD_LOG(LOG_ERR, "setsockopt failed");
+        close(sockfd);
+        return -1;
+    }
+    if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) {
+        AESD_LOG(LOG_ERR, "setsockopt SO_REUSEPORT failed: %m");
+        close(sockfd);
+        return -1;
+    }
 
-        if(exit_flag) break;
+    // Accept only after poll, never block past a connection that went away
+    int flags = fcntl(sockfd, F_GETFL);
+    if(flags == -1 || fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) == -1){
+        AESD_LOG(LOG_ERR, "Failed to make listening socket non-blocking: %m");
+        close(sockfd);
+        return -1;
+    }
 
-        //Only do timestamp every 10 seconds
-        static int counter = 0;
-        if(++counter >= 10){
-            counter = 0;
-            //Generate timestamp
-            time_t now = time(NULL);
-            struct tm *timeinfo = localtime(&now);
-            char timestamp[100];
-            strftime(timestamp, sizeof(timestamp), "timestamp:%a, %d %b %Y %T %z\n", timeinfo);
+    // Binding
+    if(bind(sockfd, ai->ai_addr, ai->ai_addrlen) == -1) {
+        AESD_LOG(LOG_ERR, "bind failed");
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
 
-            // Open data file
-            data_fd = open(OUTPUT_FILE, O_CREAT | O_APPEND | O_RDWR, 0644);
+/**
+ * Create a Unix stream socket bound to @param path, replacing a socket a
+ * previous run left there.
+ * @return the socket, or -1 after logging the failure.
+ */
+static int unix_listener_open(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    struct stat st;
+
+    if(strlen(path) >= sizeof(addr.sun_path)){
+        AESD_LOG(LOG_ERR, "Unix socket path too long: %s", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
 
-            if(data_fd == -1){
-                syslog(LOG_ERR, "Failed to open data file for timestamp");
-                continue;
-            }
+    // Only ever a stale socket, never a file that happens to have the name
+    if(lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)){
+        unlink(path);
+    }
 
-            // Lock mutex and write timestamp
-            pthread_mutex_lock(&file_mutex);
-            write(data_fd, timestamp, strlen(timestamp));
-            pthread_mutex_unlock(&file_mutex);
+    // Accept only after poll, like the TCP listeners
+    int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if(sockfd == -1){
+        AESD_LOG(LOG_ERR, "Unix socket creation failed: %m");
+        return -1;
+    }
+    if(bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1){
+        AESD_LOG(LOG_ERR, "bind to %s failed: %m", path);
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
 
-            close(data_fd);
+static void listeners_close(struct acceptor *acceptors, long count)
+{
+    for(long i = 0; i < count; i++){
+        if(acceptors[i].sockfd != -1){
+            close(acceptors[i].sockfd);
         }
     }
-#endif
-
-    pthread_exit(NULL);
 }
 
 int main(int argc, char *argv[]){
 
     int daemon_mode = 0;
+    enum serve_mode mode = MODE_THREAD;
+    long loop_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    long queue_depth = DEFAULT_QUEUE_DEPTH;
+    enum pool_overload overload = OVERLOAD_BLOCK;
+    long acceptor_count = 1;
+    bool pin_acceptors = false;
+    long backlog = BACKLOG;
+    // Durability mode of the group commit writer, -1 writes directly
+    int commit_sync = -1;
+    bool use_mmap_log = false;
+    const char *metrics_port = NULL;
+    int metrics_fd = -1;
+    long max_conns = 0;
+    long max_inflight = 0;
+    long buffer_max = CONN_BUFFER_MAX;
+    long sub_queue_max = FANOUT_QUEUE_MAX;
+    const char *unix_path = NULL;
+    enum fanout_policy sub_policy = FANOUT_DROP;
+    pthread_t metrics_tid;
+#ifndef USE_AESD_CHAR_DEVICE
     pthread_t timestamp_tid;
+#endif
+    int opt;
 
-    // Argument parsing for -d flag
-    if(argc == 2 && strcmp(argv[1], "-d") == 0){
-        daemon_mode = 1;
+    // Argument parsing
+    while((opt = getopt(argc, argv, "dm:t:q:o:i:l:a:pb:g:f:s:c:r:w:B:Q:P:u:")) != -1){
+        switch(opt){
+            case 'd':
+                daemon_mode = 1;
+                break;
+            case 'm':
+                if(strcmp(optarg, "thread") == 0){
+                    mode = MODE_THREAD;
+                } else if(strcmp(optarg, "epoll") == 0){
+                    mode = MODE_EPOLL;
+                } else if(strcmp(optarg, "pool") == 0){
+                    mode = MODE_POOL;
+                } else {
+                    fprintf(stderr, "Unknown mode '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 't':
+                loop_threads = strtol(optarg, NULL, 10);
+                if(loop_threads < 1){
+                    fprintf(stderr, "Thread count must be at least 1\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'q':
+                queue_depth = strtol(optarg, NULL, 10);
+                if(queue_depth < 1){
+                    fprintf(stderr, "Queue depth must be at least 1\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'o':
+                if(strcmp(optarg, "block") == 0){
+                    overload = OVERLOAD_BLOCK;
+                } else if(strcmp(optarg, "reject") == 0){
+                    overload = OVERLOAD_REJECT;
+                } else if(strcmp(optarg, "shed") == 0){
+                    overload = OVERLOAD_SHED;
+                } else {
+                    fprintf(stderr, "Unknown overload policy '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'i':
+                if(strcmp(optarg, "sync") == 0){
+                    io_backend = IO_SYNC;
+                } else if(strcmp(optarg, "uring") == 0){
+                    io_backend = IO_URING;
+                } else {
+                    fprintf(stderr, "Unknown I/O backend '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'l':
+                aesdlog_level = aesdlog_parse_level(optarg);
+                if(aesdlog_level == -1){
+                    fprintf(stderr, "Unknown log level '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'a':
+                acceptor_count = strtol(optarg, NULL, 10);
+                if(acceptor_count < 1){
+                    fprintf(stderr, "Acceptor count must be at least 1\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'p':
+                pin_acceptors = true;
+                break;
+            case 'b':
+                backlog = strtol(optarg, NULL, 10);
+                if(backlog < 1 || backlog > INT_MAX){
+                    fprintf(stderr, "Backlog must be between 1 and %d\n", INT_MAX);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'g':
+                if(strcmp(optarg, "none") == 0){
+                    commit_sync = COMMIT_SYNC_NONE;
+                } else if(strcmp(optarg, "periodic") == 0){
+                    commit_sync = COMMIT_SYNC_PERIODIC;
+                } else if(strcmp(optarg, "batch") == 0){
+                    commit_sync = COMMIT_SYNC_BATCH;
+                } else {
+                    fprintf(stderr, "Unknown durability mode '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'f':
+                if(strcmp(optarg, "write") == 0){
+                    use_mmap_log = false;
+                } else if(strcmp(optarg, "mmap") == 0){
+                    use_mmap_log = true;
+                } else {
+                    fprintf(stderr, "Unknown file backend '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 's':
+                metrics_port = optarg;
+                break;
+            case 'c':
+                max_conns = strtol(optarg, NULL, 10);
+                if(max_conns < 0){
+                    fprintf(stderr, "Connection limit must not be negative\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'r':
+                if(strcmp(optarg, "pause") == 0){
+                    admit_policy = ADMIT_PAUSE;
+                } else if(strcmp(optarg, "reject") == 0){
+                    admit_policy = ADMIT_REJECT;
+                } else {
+                    fprintf(stderr, "Unknown admission policy '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'w':
+                max_inflight = strtol(optarg, NULL, 10);
+                if(max_inflight < 0){
+                    fprintf(stderr, "In-flight byte limit must not be negative\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'B':
+                buffer_max = strtol(optarg, NULL, 10);
+                if(buffer_max < BUFFER_SIZE){
+                    fprintf(stderr, "Buffer cap must be at least %d\n", BUFFER_SIZE);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'u':
+                unix_path = optarg;
+                break;
+            case 'Q':
+                sub_queue_max = strtol(optarg, NULL, 10);
+                if(sub_queue_max <= 0){
+                    fprintf(stderr, "Subscriber queue limit must be positive\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'P':
+                if(strcmp(optarg, "drop") == 0){
+                    sub_policy = FANOUT_DROP;
+                } else if(strcmp(optarg, "disconnect") == 0){
+                    sub_policy = FANOUT_DISCONNECT;
+                } else {
+                    fprintf(stderr, "Unknown slow subscriber policy '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-d] [-m thread|epoll|pool] [-t threads] [-q depth] [-o block|reject|shed] [-i sync|uring] [-l err|warning|info|debug] [-a acceptors] [-p] [-b backlog] [-g none|periodic|batch] [-f write|mmap] [-s metrics_port] [-c max_conns] [-r pause|reject] [-w max_inflight_bytes] [-B max_buffer_bytes] [-Q subscriber_queue_bytes] [-P drop|disconnect] [-u unix_socket_path]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if(loop_threads < 1){
+        loop_threads = 1;
     }
-
 
     struct addrinfo *servinfo;
     struct addrinfo hints;
-    int sockfd;
     int status;
-    int yes = 1;
     struct sigaction sa;
+    long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
 
-    // Initialize linked list
-    SLIST_INIT(&head);
+    // TCP acceptors, then the Unix socket one
+    long listener_count = acceptor_count + (unix_path ? 1 : 0);
+    struct acceptor *acceptors = calloc(listener_count, sizeof(struct acceptor));
+    if(!acceptors){
+        fprintf(stderr, "Failed to allocate acceptors\n");
+        exit(EXIT_FAILURE);
+    }
+    for(long i = 0; i < listener_count; i++){
+        acceptors[i].sockfd = -1;
+        acceptors[i].cpu = (pin_acceptors && cpu_count > 0) ? i % cpu_count : -1;
+        acceptors[i].mode = mode;
+        // Initialize linked list
+        SLIST_INIT(&acceptors[i].threads);
+    }
 
     //Initialize syslog
     openlog("aesdsocket", LOG_PID, LOG_USER);
 
+    // Created before the signal handlers, they write to it
+    shutdown_fd = eventfd(0, EFD_CLOEXEC);
+    if(shutdown_fd == -1){
+        AESD_LOG(LOG_ERR, "Failed to create shutdown eventfd: %m");
+        closelog();
+        exit(EXIT_FAILURE);
+    }
+
+    if(io_backend == IO_URING){
+        if(mode == MODE_EPOLL){
+            AESD_LOG(LOG_WARNING, "io_uring backend only applies to thread and pool modes");
+            io_backend = IO_SYNC;
+        } else if(!uring_probe()){
+            AESD_LOG(LOG_WARNING, "Falling back to the sync I/O backend");
+            io_backend = IO_SYNC;
+        }
+    }
+
+#ifdef USE_AESD_CHAR_DEVICE
+    if(commit_sync != -1 || use_mmap_log){
+        AESD_LOG(LOG_WARNING, "Group commit and the mmap log only apply to the file backend");
+    }
+#else
+    if(use_mmap_log){
+        // Neither writes through a descriptor the mapping would see in order
+        if(commit_sync != -1){
+            AESD_LOG(LOG_WARNING, "Group commit does not apply to the mmap log");
+            commit_sync = -1;
+        }
+        if(io_backend == IO_URING){
+            AESD_LOG(LOG_WARNING, "io_uring backend does not apply to the mmap log");
+            io_backend = IO_SYNC;
+        }
+    }
+#endif
+
+    conn_set_buffer_max(buffer_max);
+    if(conn_set_limits(max_conns, max_inflight) == -1){
+        closelog();
+        exit(EXIT_FAILURE);
+    }
+
     // Setup signal handling
     memset(&sa, 0, sizeof(sa));
     sa.sa_handler = signal_handler;
@@ -348,12 +776,12 @@ int main(int argc, char *argv[]){
     sa.sa_flags = 0;
 
     if(sigaction(SIGINT, &sa, NULL) == -1){
-        syslog(LOG_ERR, "Failed to set up SIGINT handler");
+        AESD_LOG(LOG_ERR, "Failed to set up SIGINT handler");
         closelog();
         exit(EXIT_FAILURE);
     }
     if(sigaction(SIGTERM, &sa, NULL) == -1){
-        syslog(LOG_ERR, "Failed to set up SIGTERM handler");
+        AESD_LOG(LOG_ERR, "Failed to set up SIGTERM handler");
         closelog();
         exit(EXIT_FAILURE);
     }
@@ -368,176 +796,223 @@ int main(int argc, char *argv[]){
         exit(EXIT_FAILURE);
     }
 
-    // Socket Creation
-    sockfd = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol);
-    if (sockfd == -1) {
-        syslog(LOG_ERR, "socket creation failed");
-        freeaddrinfo(servinfo);
-        closelog();
-        exit(EXIT_FAILURE);
+    // Socket Creation, one per acceptor sharing the port when there are several
+    for(long i = 0; i < acceptor_count; i++){
+        acceptors[i].sockfd = listener_open(servinfo, acceptor_count > 1);
+        if(acceptors[i].sockfd == -1){
+            listeners_close(acceptors, listener_count);
+            freeaddrinfo(servinfo);
+            closelog();
+            exit(EXIT_FAILURE);
+        }
     }
 
-    // Set SO_REUSEADDR option to avoid "Address already in use" errors
-    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
-        syslog(LOG_ERR, "setsockopt failed");
-        close(sockfd);
-        freeaddrinfo(servinfo);
-        closelog();
-        exit(EXIT_FAILURE);
+    // Free up memory after successful bind
+    freeaddrinfo(servinfo);
+
+    if(unix_path){
+        acceptors[acceptor_count].sockfd = unix_listener_open(unix_path);
+        if(acceptors[acceptor_count].sockfd == -1){
+            listeners_close(acceptors, listener_count);
+            closelog();
+            exit(EXIT_FAILURE);
+        }
     }
 
-    // Binding
-    if(bind(sockfd, servinfo->ai_addr, servinfo->ai_addrlen) == -1) {
-        syslog(LOG_ERR, "bind failed");
-        close(sockfd);
+    if(metrics_port){
+        if((status = getaddrinfo(METRICS_HOST, metrics_port, &hints, &servinfo)) != 0) {
+            fprintf(stderr, "get addrinfo error for metrics port: %s\n", gai_strerror(status));
+            listeners_close(acceptors, listener_count);
+            exit(EXIT_FAILURE);
+        }
+        metrics_fd = listener_open(servinfo, false);
         freeaddrinfo(servinfo);
-        closelog();
-        exit(EXIT_FAILURE);
+        if(metrics_fd == -1){
+            listeners_close(acceptors, listener_count);
+            closelog();
+            exit(EXIT_FAILURE);
+        }
     }
 
-    // Free up memory after successful bind
-    freeaddrinfo(servinfo);
-
     // Daemonize if -d flag is provided
     if(daemon_mode){
-        syslog(LOG_INFO, "Starting in daemon mode");
+        AESD_LOG(LOG_INFO, "Starting in daemon mode");
         if(daemon(0,0) == -1){
-            syslog(LOG_ERR, "daemon creation failed");
+            AESD_LOG(LOG_ERR, "daemon creation failed");
             exit(EXIT_FAILURE);
         }
     }
 
+    // Hand logging to the drainer once no more forks are coming
+    aesdlog_start();
+
     // Listening
-    if(listen(sockfd, BACKLOG) == -1) {
-        syslog(LOG_ERR, "listen failed");
-        close(sockfd);
-        closelog();
-        exit(EXIT_FAILURE);
+    for(long i = 0; i < listener_count; i++){
+        if(listen(acceptors[i].sockfd, backlog) == -1) {
+            AESD_LOG(LOG_ERR, "listen failed");
+            listeners_close(acceptors, listener_count);
+            aesdlog_stop();
+            closelog();
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if(metrics_fd != -1 && listen(metrics_fd, BACKLOG) == -1){
+        AESD_LOG(LOG_ERR, "listen on metrics port failed: %m");
+        close(metrics_fd);
+        metrics_fd = -1;
     }
 
-    syslog(LOG_INFO, "Socket successfully created, bound to port %s, and listening", PORT);
+    AESD_LOG(LOG_INFO, "Socket successfully created, bound to port %s, and listening on %ld acceptors%s%s", PORT, acceptor_count,
+             unix_path ? " and " : "", unix_path ? unix_path : "");
 
     // Signal that server is ready for test scripts
     printf("SERVER_READY\n");
     fflush(stdout); // Flush the output buffer
 
-    // Start timestamp thread (even for char device to maintain thread structure)
+#ifndef USE_AESD_CHAR_DEVICE
+    if(use_mmap_log && mmap_log_open() == -1){
+        AESD_LOG(LOG_WARNING, "mmap log unavailable, writing through the file");
+    }
+    if(commit_sync != -1){
+        if(group_commit_start(commit_sync) == -1){
+            AESD_LOG(LOG_WARNING, "Group commit unavailable, writing directly");
+        }
+    }
+
+    // Start timestamp thread, the char device needs none
     if(pthread_create(&timestamp_tid, NULL, timestamp_thread_func, NULL) != 0){
-        syslog(LOG_ERR, "Failed to create timestamp thread");
-        close(sockfd);
+        AESD_LOG(LOG_ERR, "Failed to create timestamp thread");
+        listeners_close(acceptors, listener_count);
+        aesdlog_stop();
         closelog();
         exit(EXIT_FAILURE);
     }
+#endif
 
-    // Set socket timeout
-    struct timeval timeout;
-    timeout.tv_sec = 1;
-    timeout.tv_usec = 0;
-    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-
-    // Main server loop code
-    while(!exit_flag) {
-        struct sockaddr_storage client_addr;
-        socklen_t addr_len = sizeof(client_addr);
-        char client_ip[INET6_ADDRSTRLEN];
-        int client_fd;
+    if(fanout_start(sub_queue_max, sub_policy) == -1){
+        AESD_LOG(LOG_WARNING, "Fanout unavailable, %s is refused", SUBSCRIBE_COMMAND);
+    }
 
-        // Accept connection
-        client_fd = accept(sockfd, (struct sockaddr *)&client_addr, &addr_len);
-        if (client_fd == -1) {
-            // ADD DEBUG LOGGING:
-            syslog(LOG_DEBUG, "accept failed. errno: %d, exit_flag: %d", errno, exit_flag);
-            if(errno == EAGAIN || errno == EWOULDBLOCK){
-                // Timeout, check exit_flag, and continue
-                continue;
-            }
-            if (exit_flag) {
-                syslog(LOG_DEBUG, "Breaking loop due to exit_flag"); // ADD THIS
-                break;
-            }
-            if (errno == EINTR) {
-                syslog(LOG_DEBUG, "accept was interrupted by a signal"); // ADD THIS
-                if (exit_flag) {
-                    break;
-                }
-                continue;
-            }
-            syslog(LOG_ERR, "accept failed: %m");
-            continue;
+    if(mode == MODE_EPOLL){
+        // Every connection holds a socket and a data fd, allow as many as we may
+        struct rlimit rl;
+        if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max){
+            rl.rlim_cur = rl.rlim_max;
+            setrlimit(RLIMIT_NOFILE, &rl);
         }
 
-        // Get client IP address
-        if(client_addr.ss_family == AF_INET) {
-            struct sockaddr_in *s = (struct sockaddr_in *)&client_addr;
-            inet_ntop(AF_INET, &s->sin_addr, client_ip, sizeof(client_ip));
-        } else{
-            struct sockaddr_in6 *s = (struct sockaddr_in6 *)&client_addr;
-            inet_ntop(AF_INET6, &s->sin6_addr, client_ip, sizeof(client_ip));
+        if(event_loops_start(loop_threads) == -1){
+            AESD_LOG(LOG_ERR, "Failed to start event loops");
+            server_shutdown();
+#ifndef USE_AESD_CHAR_DEVICE
+            pthread_join(timestamp_tid, NULL);
+#endif
+            listeners_close(acceptors, listener_count);
+            aesdlog_stop();
+            closelog();
+            exit(EXIT_FAILURE);
         }
-
-        syslog(LOG_INFO, "Accepted connection from %s", client_ip);
-
-        // Create new thread data structure
-        struct thread_data *tdata = malloc(sizeof(struct thread_data));
-        if(!tdata){
-            syslog(LOG_ERR, "Failed to allocate thread data");
-            close(client_fd);
-            continue;
+    } else if(mode == MODE_POOL){
+        if(worker_pool_start(loop_threads, queue_depth, overload) == -1){
+            AESD_LOG(LOG_ERR, "Failed to start worker pool");
+            server_shutdown();
+#ifndef USE_AESD_CHAR_DEVICE
+            pthread_join(timestamp_tid, NULL);
+#endif
+            listeners_close(acceptors, listener_count);
+            aesdlog_stop();
+            closelog();
+            exit(EXIT_FAILURE);
         }
+    }
 
-        tdata->socket_fd = client_fd;
-        tdata->thread_complete = false;
-
-        // Insert into linked list
-        SLIST_INSERT_HEAD(&head, tdata, entries);
-
-        // Create client thread;
-        if(pthread_create(&tdata->thread_id, NULL, client_thread_func, tdata) != 0){
-            syslog(LOG_ERR, "Failed to create client thread");
-            SLIST_REMOVE(&head, tdata, thread_data, entries);
-            free(tdata);
-            close(client_fd);
-            continue;
+    // Main server loop code, main itself only waits for shutdown
+    long started;
+    for(started = 0; started < listener_count; started++){
+        if(pthread_create(&acceptors[started].thread_id, NULL, acceptor_thread_func, &acceptors[started]) != 0){
+            AESD_LOG(LOG_ERR, "Failed to create acceptor thread %ld", started);
+            server_shutdown();
+            break;
         }
+    }
 
+    if(metrics_fd != -1 && pthread_create(&metrics_tid, NULL, metrics_thread_func, &metrics_fd) != 0){
+        AESD_LOG(LOG_ERR, "Failed to create metrics thread, metrics only through %s", STATS_COMMAND);
+        close(metrics_fd);
+        metrics_fd = -1;
+    }
 
-        // Clean up completed threads
-        struct thread_data *tdata_temp, *tdata_iter;
-        SLIST_FOREACH_SAFE(tdata_iter, &head, entries, tdata_temp) {
-            if(tdata_iter->thread_complete){
-                pthread_join(tdata_iter->thread_id, NULL);
-                SLIST_REMOVE(&head, tdata_iter, thread_data, entries);
-                free(tdata_iter);
-            }
-        }
+    struct pollfd shutdown_poll = { .fd = shutdown_fd, .events = POLLIN };
+    while(poll(&shutdown_poll, 1, -1) == -1 && errno == EINTR){
     }
     // End Main server loop
-    
+
     // Cleanup
-    syslog(LOG_INFO, "Caught signal, exiting");
+    AESD_LOG(LOG_INFO, "Caught signal, exiting");
+
+    // Wake every thread blocked on a client, whatever it is waiting in
+    conn_shutdown_all();
+
+    for(long i = 0; i < started; i++){
+        pthread_join(acceptors[i].thread_id, NULL);
+    }
+    if(metrics_fd != -1){
+        pthread_join(metrics_tid, NULL);
+        close(metrics_fd);
+    }
 
+#ifndef USE_AESD_CHAR_DEVICE
     // Join timestamp thread
     pthread_join(timestamp_tid, NULL);
+#endif
+
+    if(mode == MODE_EPOLL){
+        event_loops_stop();
+    } else if(mode == MODE_POOL){
+        worker_pool_stop();
+    }
 
     // Join all remaning client threads
-    struct thread_data *tdata_temp, *tdata_iter;
-    SLIST_FOREACH_SAFE(tdata_iter, &head, entries, tdata_temp){
-        pthread_join(tdata_iter->thread_id, NULL);
-        SLIST_REMOVE(&head, tdata_iter, thread_data, entries);
-        free(tdata_iter);
+    for(long i = 0; i < listener_count; i++){
+        struct thread_data *tdata_temp, *tdata_iter;
+        SLIST_FOREACH_SAFE(tdata_iter, &acceptors[i].threads, entries, tdata_temp){
+            pthread_join(tdata_iter->thread_id, NULL);
+            SLIST_REMOVE(&acceptors[i].threads, tdata_iter, thread_data, entries);
+            free(tdata_iter);
+        }
     }
 
-#ifndef USE_AESD_CHAR_DEVICE
+    fanout_stop();
+
+#ifdef USE_AESD_CHAR_DEVICE
+    readback_cache_close();
+#else
+    // Every writer is gone, commit whatever is left
+    group_commit_stop();
+    mmap_log_close();
+
     // Delete the data file only for file-based implementation
     if(unlink(OUTPUT_FILE) == -1){
-        syslog(LOG_ERR, "Failed to delete data file");
+        AESD_LOG(LOG_ERR, "Failed to delete data file");
     }
 #endif
 
-#ifndef USE_AESD_CHAR_DEVICE
     pthread_mutex_destroy(&file_mutex);
-#endif
-    close(sockfd);
+    listeners_close(acceptors, listener_count);
+    free(acceptors);
+    if(unix_path){
+        unlink(unix_path);
+    }
+
+    if(shutdown_start.tv_sec != 0){
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        AESD_LOG(LOG_INFO, "Shutdown took %ld ms",
+                 (now.tv_sec - shutdown_start.tv_sec) * 1000 + (now.tv_nsec - shutdown_start.tv_nsec) / 1000000);
+    }
+    aesdlog_stop();
+    close(shutdown_fd);
     closelog();
 
     return 0;
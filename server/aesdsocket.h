@@ -0,0 +1,57 @@
+/*
+ * aesdsocket.h
+ *
+ *  Shared definitions for the aesdsocket server and its connection handlers
+ */
+
+#ifndef AESDSOCKET_H
+#define AESDSOCKET_H
+
+#include "signal.h"
+#include "pthread.h"
+
+// The char device is the default backend, -DUSE_AESD_CHAR_DEVICE=0 (make
+// USE_CHAR_DEVICE=0) selects the data file instead
+#if !defined(USE_AESD_CHAR_DEVICE)
+#define USE_AESD_CHAR_DEVICE 1
+#elif USE_AESD_CHAR_DEVICE == 0
+#undef USE_AESD_CHAR_DEVICE
+#endif
+#define BACKLOG 10
+#define PORT "9000"
+#define BUFFER_SIZE 1024
+#define TIMESTAMP_INTERVAL 10
+
+// Add the build switch for char device
+#ifdef USE_AESD_CHAR_DEVICE
+#define OUTPUT_FILE "/dev/aesdchar"
+#else
+#define OUTPUT_FILE "/var/tmp/aesdsocketdata"
+#endif
+
+// Data path used by the blocking serving modes
+enum io_backend {
+    IO_SYNC,    // recv/write/lseek/read/send syscalls
+    IO_URING,   // Linked io_uring submissions, falls back to IO_SYNC
+};
+
+// Set by server_shutdown(), checked by every thread once it is woken
+extern volatile sig_atomic_t exit_flag;
+
+// eventfd that turns readable, and stays so, when shutdown starts.  Every
+// idle wait includes it instead of waking up periodically.
+extern int shutdown_fd;
+
+/**
+ * Set exit_flag and make shutdown_fd readable.  Async-signal-safe.
+ */
+void server_shutdown(void);
+
+extern enum io_backend io_backend;
+
+// Serializes appends to the data file, readers only hold it to snapshot its
+// length.  The char driver orders writes on its own, there it keeps pushes
+// to subscribers in the same order.
+extern pthread_mutex_t file_mutex;
+
+#endif /* AESDSOCKET_H */
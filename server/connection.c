@@ -0,0 +1,1087 @@
+#define _DEFAULT_SOURCE
+#include "sys/socket.h"
+#include "sys/types.h"
+#include "syslog.h"
+#include "unistd.h"
+#include "fcntl.h"
+#include "string.h"
+#include "stdlib.h"
+#include "stdio.h"
+#include "errno.h"
+#include "stdbool.h"
+#include "pthread.h"
+#include "sys/ioctl.h"
+#include "sys/stat.h"
+#include "sys/sendfile.h"
+#include "sys/eventfd.h"
+#include "arpa/inet.h"
+#include "stdint.h"
+#include "aesd_ioctl.h"
+#include "aesd_frame.h"
+#include "aesdsocket.h"
+#include "connection.h"
+#include "uring_io.h"
+#include "group_commit.h"
+#include "mmap_log.h"
+#include "readback_cache.h"
+#include "fanout.h"
+#include "shm_ring.h"
+#include "shm_transport.h"
+#include "metrics.h"
+#include "aesdlog.h"
+
+static const struct conn_ops sync_ops;
+
+static LIST_HEAD(conn_list, aesd_conn) live_conns = LIST_HEAD_INITIALIZER(live_conns);
+static pthread_mutex_t live_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool live_shutdown;
+
+// Admission state, the limits are fixed before serving starts
+static long max_conns;
+static size_t max_inflight;
+static long admitted;
+static int admit_fd = -1;
+
+static size_t buffer_max = CONN_BUFFER_MAX;
+
+void conn_set_buffer_max(size_t max)
+{
+    buffer_max = max < BUFFER_SIZE ? BUFFER_SIZE : max;
+}
+
+size_t conn_buffer_max(void)
+{
+    return buffer_max;
+}
+
+/**
+ * Make @param buf hold @param want bytes, clamped to [BUFFER_SIZE,
+ * buffer_max].  The old contents are not kept.
+ * @return the usable size, which stays the old one if allocation fails.
+ */
+static size_t conn_buf_size(char **buf, size_t *cap, size_t want)
+{
+    if(want > buffer_max){
+        want = buffer_max;
+    }
+    if(want < BUFFER_SIZE){
+        want = BUFFER_SIZE;
+    }
+    if(want <= *cap){
+        return *cap;
+    }
+
+    // Nothing to preserve, skip the copy realloc would make
+    char *new_buf = malloc(want);
+    if(!new_buf){
+        AESD_LOG(LOG_WARNING, "Failed to grow buffer to %zu bytes", want);
+        return *cap;
+    }
+    free(*buf);
+    *buf = new_buf;
+    *cap = want;
+    return *cap;
+}
+
+int conn_set_limits(long conns, size_t inflight)
+{
+    max_conns = conns;
+    max_inflight = inflight;
+    if(max_conns > 0 && admit_fd == -1){
+        admit_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(admit_fd == -1){
+            AESD_LOG(LOG_ERR, "Failed to create admission eventfd: %m");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+bool conn_admit(void)
+{
+    long held = __atomic_load_n(&admitted, __ATOMIC_RELAXED);
+
+    do {
+        if(max_conns > 0 && held >= max_conns){
+            return false;
+        }
+    } while(!__atomic_compare_exchange_n(&admitted, &held, held + 1, true,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+    return true;
+}
+
+int conn_admit_fd(void)
+{
+    return admit_fd;
+}
+
+static void conn_release(void)
+{
+    uint64_t one = 1;
+
+    // Only a release from the limit can have an acceptor waiting on it
+    if(__atomic_fetch_sub(&admitted, 1, __ATOMIC_SEQ_CST) == max_conns && admit_fd != -1){
+        if(write(admit_fd, &one, sizeof(one)) == -1){
+            // Counter saturated, it is readable anyway
+        }
+    }
+}
+
+void conn_drop(int client_fd)
+{
+    close(client_fd);
+    conn_release();
+}
+
+int conn_open(struct aesd_conn *conn, int client_fd, bool nonblocking)
+{
+    memset(conn, 0, sizeof(*conn));
+    conn->client_fd = client_fd;
+    conn->nonblocking = nonblocking;
+    conn->state = CONN_READING;
+    conn->ops = &sync_ops;
+    conn->recv_size = BUFFER_SIZE;
+
+#ifdef USE_AESD_CHAR_DEVICE
+    // Open char device once per connection and keep it open
+    conn->data_fd = open(OUTPUT_FILE, O_RDWR);
+    if(conn->data_fd == -1){
+        AESD_LOG(LOG_ERR, "Failed to open char device");
+        return -1;
+    }
+    AESD_LOG(LOG_DEBUG, "Opened char device fd: %d", conn->data_fd);
+#else
+    if(mmap_log_active()){
+        // Appends and readback go through the shared mapping
+        conn->data_fd = -1;
+    } else {
+        // Open file to enter data (original implementation)
+        conn->data_fd = open(OUTPUT_FILE, O_CREAT | O_APPEND | O_RDWR, 0644);
+        if(conn->data_fd == -1){
+            AESD_LOG(LOG_ERR, "Failed to open data file");
+            return -1;
+        }
+    }
+#endif
+
+    pthread_mutex_lock(&live_lock);
+    LIST_INSERT_HEAD(&live_conns, conn, live);
+    if(live_shutdown){
+        shutdown(client_fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&live_lock);
+
+    metrics_inc(METRIC_CONN_OPENED);
+    return 0;
+}
+
+void conn_close(struct aesd_conn *conn)
+{
+    // Unregister first so conn_shutdown_all() never touches a reused fd
+    pthread_mutex_lock(&live_lock);
+    LIST_REMOVE(conn, live);
+    pthread_mutex_unlock(&live_lock);
+    metrics_inc(METRIC_CONN_CLOSED);
+
+    if(conn->subscribed){
+        fanout_unsubscribe(conn);
+    }
+    if(conn->shm){
+        shm_session_close(conn->shm);
+        conn->shm = NULL;
+    }
+    close(conn->client_fd);
+    if(conn->data_fd != -1) {
+        close(conn->data_fd);
+        AESD_LOG(LOG_DEBUG, "Closed char device fd: %d", conn->data_fd);
+        conn->data_fd = -1;
+    }
+    free(conn->rx_buf);
+    conn->rx_buf = NULL;
+    conn->rx_len = conn->rx_cap = 0;
+    free(conn->rb_buf);
+    conn->rb_buf = NULL;
+    conn->rb_cap = 0;
+    free(conn->tx_buf);
+    conn->tx_buf = NULL;
+    conn->tx_len = conn->tx_off = conn->tx_cap = 0;
+    conn_release();
+}
+
+void conn_shutdown_all(void)
+{
+    struct aesd_conn *conn;
+
+    pthread_mutex_lock(&live_lock);
+    live_shutdown = true;
+    LIST_FOREACH(conn, &live_conns, live){
+        shutdown(conn->client_fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&live_lock);
+}
+
+// Append to the tx queue, compacting already sent bytes before growing it
+static int conn_queue(struct aesd_conn *conn, const char *data, size_t len)
+{
+    if(conn->tx_off > 0){
+        memmove(conn->tx_buf, conn->tx_buf + conn->tx_off, conn->tx_len - conn->tx_off);
+        conn->tx_len -= conn->tx_off;
+        conn->tx_off = 0;
+    }
+
+    // A client that stops reading may not pile up readback without bound
+    if(max_inflight > 0 && conn->tx_len + len > max_inflight){
+        AESD_LOG(LOG_WARNING, "Closing connection with %zu bytes in flight, limit %zu",
+                 conn->tx_len + len, max_inflight);
+        metrics_inc(METRIC_INFLIGHT_CLOSED);
+        conn->tx_overflow = true;
+        return -1;
+    }
+
+    if(conn->tx_len + len > conn->tx_cap){
+        size_t new_cap = conn->tx_cap ? conn->tx_cap : BUFFER_SIZE;
+        while(new_cap < conn->tx_len + len){
+            new_cap *= 2;
+        }
+        char *new_buf = realloc(conn->tx_buf, new_cap);
+        if(!new_buf){
+            AESD_LOG(LOG_ERR, "Failed to grow tx queue to %zu bytes", new_cap);
+            return -1;
+        }
+        conn->tx_buf = new_buf;
+        conn->tx_cap = new_cap;
+    }
+
+    memcpy(conn->tx_buf + conn->tx_len, data, len);
+    conn->tx_len += len;
+    return 0;
+}
+
+int conn_send(struct aesd_conn *conn, const char *data, size_t len)
+{
+    // Anything already queued has to reach the client first to keep ordering
+    if(!conn_tx_pending(conn)){
+        while(len > 0){
+            ssize_t sent = send(conn->client_fd, data, len, MSG_NOSIGNAL);
+            if(sent == -1){
+                if(errno == EINTR){
+                    continue;
+                }
+                if(conn->nonblocking && (errno == EAGAIN || errno == EWOULDBLOCK)){
+                    break;
+                }
+                AESD_LOG(LOG_ERR, "Failed to send data to client");
+                metrics_inc(METRIC_SEND_ERRORS);
+                return -1;
+            }
+            metrics_add(METRIC_BYTES_OUT, sent);
+            data += sent;
+            len -= sent;
+        }
+    }
+
+    if(len == 0){
+        return 0;
+    }
+    return conn_queue(conn, data, len);
+}
+
+int conn_flush(struct aesd_conn *conn)
+{
+    while(conn_tx_pending(conn)){
+        ssize_t sent = send(conn->client_fd, conn->tx_buf + conn->tx_off,
+                            conn->tx_len - conn->tx_off, MSG_NOSIGNAL);
+        if(sent == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                return 0;
+            }
+            AESD_LOG(LOG_ERR, "Failed to send data to client");
+            metrics_inc(METRIC_SEND_ERRORS);
+            return -1;
+        }
+        metrics_add(METRIC_BYTES_OUT, sent);
+        conn->tx_off += sent;
+    }
+
+    conn->tx_len = conn->tx_off = 0;
+    return 1;
+}
+
+#ifdef USE_AESD_CHAR_DEVICE
+/**
+ * Send the history in @param snap from stream offset @param from on,
+ * nothing if it is not that long, and remember its end for delta readbacks.
+ * @return the bytes sent.
+ */
+static ssize_t conn_send_snapshot(struct aesd_conn *conn, const struct readback_snapshot *snap,
+                                  uint64_t from)
+{
+    uint64_t end = snap->base + snap->len;
+    ssize_t total_sent = 0;
+
+    if(from < snap->base){
+        from = snap->base;
+    }
+    if(from < end && conn_send(conn, snap->data + (from - snap->base), end - from) == 0){
+        total_sent = end - from;
+    }
+    conn->readback_end = end;
+    return total_sent;
+}
+
+int conn_readback_packet(struct aesd_conn *conn)
+{
+    uint64_t start = metrics_now();
+
+    // Send ALL content from the beginning for normal writes, or what is
+    // new in delta mode, from the history shared with other clients
+    struct readback_snapshot *snap = readback_cache_get();
+    if(!snap){
+        // The client is waiting for it, skipping would leave it hanging
+        AESD_LOG(LOG_ERR, "No history to read back to fd %d, closing", conn->client_fd);
+        return -1;
+    }
+    ssize_t total_sent = conn_send_snapshot(conn, snap,
+            conn_readback_start(conn, snap->base, snap->base + snap->len));
+    readback_cache_put(snap);
+    metrics_observe(HIST_READBACK, start);
+    AESD_LOG(LOG_DEBUG, "Sent %zd bytes back to client", total_sent);
+    return 0;
+}
+#else
+// Copy [offset, end) of the data file with pread, queueing on a full socket
+static ssize_t conn_readback_range(struct aesd_conn *conn, off_t offset, off_t end)
+{
+    off_t start = offset;
+    size_t cap = conn_buf_size(&conn->rb_buf, &conn->rb_cap, end - offset);
+
+    if(!conn->rb_buf){
+        return 0;
+    }
+    while(offset < end){
+        size_t want = (size_t)(end - offset) < cap ? (size_t)(end - offset) : cap;
+        ssize_t bytes_read = pread(conn->data_fd, conn->rb_buf, want, offset);
+        if(bytes_read <= 0){
+            break;
+        }
+        if(conn_send(conn, conn->rb_buf, bytes_read) == -1){
+            break;
+        }
+        offset += bytes_read;
+    }
+    return offset - start;
+}
+
+/**
+ * Send bytes [@param offset, @param size) of the data file with sendfile(2), so
+ * the history goes from the page cache to the socket without a copy through
+ * user space.  The file is append only, so a size captured under file_mutex
+ * is a consistent snapshot and the streaming itself needs no lock.  Whatever
+ * a non-blocking socket refuses is copied into the tx queue instead, from
+ * the mapping when the mmap log is in use.
+ * @return the bytes sent or queued, short of the range once sending failed.
+ */
+static ssize_t conn_readback_file(struct aesd_conn *conn, int data_fd, off_t offset, off_t size)
+{
+    off_t start = offset;
+
+    while(offset < size){
+        ssize_t sent = sendfile(conn->client_fd, data_fd, &offset, size - offset);
+        if(sent == 0){
+            break;
+        }
+        if(sent > 0){
+            metrics_add(METRIC_BYTES_OUT, sent);
+            continue;
+        }
+        if(errno == EINTR){
+            continue;
+        }
+        if(errno == EINVAL || errno == ENOSYS || (conn->nonblocking && errno == EAGAIN)){
+            // Copy the rest through the regular path, which queues on EAGAIN
+            if(mmap_log_active()){
+                if(conn_send(conn, mmap_log_data() + offset, size - offset) == -1){
+                    return offset - start;
+                }
+                return size - start;
+            }
+            return offset - start + conn_readback_range(conn, offset, size);
+        }
+        AESD_LOG(LOG_ERR, "Failed to send data to client");
+        metrics_inc(METRIC_SEND_ERRORS);
+        break;
+    }
+    return offset - start;
+}
+
+/**
+ * @return the history length, a snapshot no writer is halfway through, or
+ * -1 on failure.
+ */
+static off_t conn_history_size(struct aesd_conn *conn)
+{
+    struct stat st;
+    off_t size;
+
+    if(mmap_log_active()){
+        return mmap_log_length();
+    }
+    // Writers hold the lock until their write is complete
+    pthread_mutex_lock(&file_mutex);
+    size = fstat(conn->data_fd, &st) == -1 ? -1 : st.st_size;
+    pthread_mutex_unlock(&file_mutex);
+    return size;
+}
+#endif
+
+#ifdef USE_AESD_CHAR_DEVICE
+static int sync_append(struct aesd_conn *conn, const char *data, size_t len, bool complete)
+{
+    uint64_t start = metrics_now();
+
+    // Write data to char device, under file_mutex so subscribers are pushed
+    // writes in the order the device stored them
+    pthread_mutex_lock(&file_mutex);
+    if(write(conn->data_fd, data, len) == -1){
+        AESD_LOG(LOG_ERR, "Failed to write to char device");
+        pthread_mutex_unlock(&file_mutex);
+        return -1;
+    }
+    readback_cache_invalidate();
+    fanout_publish(data, len);
+    pthread_mutex_unlock(&file_mutex);
+    metrics_observe(HIST_WRITE, start);
+    AESD_LOG(LOG_DEBUG, "Wrote %zu bytes to char device", len);
+
+    if(complete){
+        AESD_LOG(LOG_DEBUG, "Packet complete, reading back all content");
+        return conn_readback_packet(conn);
+    }
+    return 0;
+}
+
+static int sync_seek_readback(struct aesd_conn *conn, const struct aesd_seekto *seekto)
+{
+    AESD_LOG(LOG_DEBUG, "Sending ioctl: write_cmd=%u, write_cmd_offset=%u",
+           seekto->write_cmd, seekto->write_cmd_offset);
+
+    if(ioctl(conn->data_fd, AESDCHAR_IOCSEEKTO, seekto) == -1){
+        AESD_LOG(LOG_ERR, "ioctl seek failed: %m");
+        // Don't close - continue processing
+        return 0;
+    }
+
+    AESD_LOG(LOG_DEBUG, "ioctl seek successful, reading from current position");
+
+    // Send from the current position (set by ioctl)
+    uint64_t start = metrics_now();
+    struct readback_snapshot *snap = readback_cache_get();
+    if(!snap){
+        // The client is waiting for it, skipping would leave it hanging
+        AESD_LOG(LOG_ERR, "No history to read back to fd %d, closing", conn->client_fd);
+        return -1;
+    }
+    // The position is in what the device holds, the snapshot starts there too
+    ssize_t total_sent = conn_send_snapshot(conn, snap, snap->base + lseek(conn->data_fd, 0, SEEK_CUR));
+    readback_cache_put(snap);
+    metrics_observe(HIST_READBACK, start);
+    AESD_LOG(LOG_DEBUG, "Finished sending seek response, total %zd bytes", total_sent);
+    return 0;
+}
+#else
+// Send back the history of @param data_fd up to @param size, timed
+static void sync_readback(struct aesd_conn *conn, int data_fd, off_t size)
+{
+    uint64_t start = metrics_now();
+
+    conn_readback_file(conn, data_fd, conn_readback_start(conn, 0, size), size);
+    conn->readback_end = size;
+    metrics_observe(HIST_READBACK, start);
+}
+
+static int sync_append(struct aesd_conn *conn, const char *data, size_t len, bool complete)
+{
+    struct stat st;
+    uint64_t start = metrics_now();
+
+    if(mmap_log_active()){
+        off_t end = mmap_log_append(data, len);
+        if(end == -1){
+            return -1;
+        }
+        metrics_observe(HIST_WRITE, start);
+        if(complete){
+            sync_readback(conn, mmap_log_fd(), end);
+        }
+        return 0;
+    }
+
+    if(group_commit_active()){
+        // The committer batches this with other clients' chunks
+        off_t end = group_commit_append(data, len);
+        if(end == -1){
+            return -1;
+        }
+        metrics_observe(HIST_WRITE, start);
+        if(complete){
+            sync_readback(conn, conn->data_fd, end);
+        }
+        return 0;
+    }
+
+    // Lock mutex for file writing
+    pthread_mutex_lock(&file_mutex);
+
+    //Write data that's receive to the file
+    if(write(conn->data_fd, data, len) == -1){
+        AESD_LOG(LOG_ERR, "Failed to write to data file");
+        pthread_mutex_unlock(&file_mutex);
+        return -1;
+    }
+    fanout_publish(data, len);
+
+    // Capture the history length while no other writer can append
+    if(complete && fstat(conn->data_fd, &st) == -1){
+        AESD_LOG(LOG_ERR, "Failed to stat data file: %m");
+        complete = false;
+    }
+
+    pthread_mutex_unlock(&file_mutex);
+    metrics_observe(HIST_WRITE, start);
+
+    // Send entire file content back to client, outside the lock so a slow
+    // reader doesn't stall every writer
+    if(complete){
+        sync_readback(conn, conn->data_fd, st.st_size);
+    }
+    return 0;
+}
+
+static int sync_seek_readback(struct aesd_conn *conn, const struct aesd_seekto *seekto)
+{
+    AESD_LOG(LOG_WARNING, "Seek command received but not supported in file mode");
+    return 0;
+}
+#endif
+
+int conn_append(struct aesd_conn *conn, const char *data, size_t len, bool complete)
+{
+    // The data path publishes while its write is still ordered against others
+    return conn->ops->append(conn, data, len, complete);
+}
+
+static const struct conn_ops sync_ops = {
+    .append = sync_append,
+    .seek_readback = sync_seek_readback,
+};
+
+bool conn_parse_seek(const char *line, size_t len, struct aesd_seekto *seekto)
+{
+    static const char prefix[] = "AESDCHAR_IOCSEEKTO:";
+    const size_t prefix_len = sizeof(prefix) - 1;
+    unsigned int write_cmd = 0, write_cmd_offset = 0;
+    char args[32];
+
+    if(len < prefix_len || memcmp(line, prefix, prefix_len) != 0){
+        return false;
+    }
+
+    // Copy the arguments out so they can be NUL terminated for sscanf,
+    // trailing newline and whitespace are skipped by the conversion
+    len -= prefix_len;
+    if(len >= sizeof(args)){
+        AESD_LOG(LOG_ERR, "Seek command too long (%zu bytes)", len);
+        return false;
+    }
+    memcpy(args, line + prefix_len, len);
+    args[len] = '\0';
+
+    // Parse this seek command
+    if(sscanf(args, "%u,%u", &write_cmd, &write_cmd_offset) != 2){
+        AESD_LOG(LOG_ERR, "Failed to parse seek command: '%s'", args);
+        return false;
+    }
+
+    AESD_LOG(LOG_DEBUG, "Processing seek command: cmd=%u, offset=%u",
+        write_cmd, write_cmd_offset);
+    seekto->write_cmd = write_cmd;
+    seekto->write_cmd_offset = write_cmd_offset;
+    return true;
+}
+
+// Make room for @param len more bytes of carried over input
+static int conn_rx_reserve(struct aesd_conn *conn, size_t len)
+{
+    if(conn->rx_len + len <= conn->rx_cap){
+        return 0;
+    }
+
+    size_t new_cap = conn->rx_cap ? conn->rx_cap : BUFFER_SIZE;
+    while(new_cap < conn->rx_len + len){
+        new_cap *= 2;
+    }
+    char *new_buf = realloc(conn->rx_buf, new_cap);
+    if(!new_buf){
+        AESD_LOG(LOG_ERR, "Failed to grow rx buffer to %zu bytes", new_cap);
+        return -1;
+    }
+    conn->rx_buf = new_buf;
+    conn->rx_cap = new_cap;
+    return 0;
+}
+
+// A line holding just @param command, trailing whitespace allowed
+static bool conn_line_is(const char *line, size_t len, const char *command)
+{
+    const size_t command_len = strlen(command);
+
+    while(len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r' || line[len - 1] == ' ')){
+        len--;
+    }
+    return len == command_len && memcmp(line, command, command_len) == 0;
+}
+
+// Answer a STATS_COMMAND with the rendered metrics, nothing is stored
+static int conn_send_stats(struct aesd_conn *conn)
+{
+    size_t len;
+    char *text = metrics_render(&len);
+
+    if(!text){
+        return 0;
+    }
+    int rc = conn_send(conn, text, len);
+    free(text);
+    return rc;
+}
+
+/**
+ * Recognize "<@param prefix><number>" in the @param len bytes at @param line.
+ * @return true and fill @param value if it is a valid command.
+ */
+static bool conn_parse_number(const char *line, size_t len, const char *prefix,
+                              unsigned long long *value)
+{
+    const size_t prefix_len = strlen(prefix);
+    char arg[32];
+
+    if(len < prefix_len || memcmp(line, prefix, prefix_len) != 0){
+        return false;
+    }
+    len -= prefix_len;
+    if(len >= sizeof(arg)){
+        AESD_LOG(LOG_ERR, "%s command too long (%zu bytes)", prefix, len);
+        return false;
+    }
+    memcpy(arg, line + prefix_len, len);
+    arg[len] = '\0';
+    if(sscanf(arg, "%llu", value) != 1){
+        AESD_LOG(LOG_ERR, "Failed to parse %s command: '%s'", prefix, arg);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Send the history from byte @param offset to its end, nothing if it is
+ * not that long.  @return 0, or -1 if the connection has to be closed.
+ */
+static int conn_send_tail(struct aesd_conn *conn, unsigned long long offset)
+{
+    uint64_t start = metrics_now();
+
+#ifdef USE_AESD_CHAR_DEVICE
+    struct readback_snapshot *snap = readback_cache_get();
+    if(!snap){
+        // The client is waiting for it, skipping would leave it hanging
+        AESD_LOG(LOG_ERR, "No history to read back to fd %d, closing", conn->client_fd);
+        return -1;
+    }
+    conn_send_snapshot(conn, snap, offset);
+    readback_cache_put(snap);
+#else
+    off_t end = conn_history_size(conn);
+    if(end == -1){
+        AESD_LOG(LOG_ERR, "Failed to size the history: %m");
+        return 0;
+    }
+    if(offset > (unsigned long long)end){
+        offset = end;
+    }
+    conn_readback_file(conn, mmap_log_active() ? mmap_log_fd() : conn->data_fd, offset, end);
+    conn->readback_end = end;
+#endif
+
+    metrics_observe(HIST_READBACK, start);
+    return conn->tx_overflow ? -1 : 0;
+}
+
+// Hand the socket to the fanout, with whatever readback is still queued
+static void conn_subscribe(struct aesd_conn *conn)
+{
+    if(fanout_subscribe(conn, conn->tx_buf + conn->tx_off, conn->tx_len - conn->tx_off) == -1){
+        AESD_LOG(LOG_ERR, "Subscription refused, serving fd %d as before", conn->client_fd);
+        return;
+    }
+    conn->subscribed = true;
+    conn->tx_len = conn->tx_off = 0;
+}
+
+/**
+ * Offer the shared memory ring, only a blocking connection on the sync data
+ * path has a thread of its own to wait on it.
+ * @return 0, or -1 if the connection has to be closed.
+ */
+static int conn_offer_shm(struct aesd_conn *conn)
+{
+    if(!conn->shm && !conn->nonblocking && conn->ops == &sync_ops){
+        conn->shm = shm_session_open(conn->client_fd);
+    }
+    if(conn->shm){
+        return 0;
+    }
+    return conn_send(conn, SHM_NEGOTIATE_NAK, strlen(SHM_NEGOTIATE_NAK));
+}
+
+// Dispatch one newline terminated command
+static int conn_handle_line(struct aesd_conn *conn, const char *line, size_t len)
+{
+    struct aesd_seekto seekto;
+    unsigned long long value;
+
+    if(conn_line_is(line, len, STATS_COMMAND)){
+        return conn_send_stats(conn);
+    }
+
+    if(conn_line_is(line, len, SHM_NEGOTIATE)){
+        return conn_offer_shm(conn);
+    }
+
+    if(conn_line_is(line, len, SUBSCRIBE_COMMAND)){
+        conn_subscribe(conn);
+        return 0;
+    }
+
+    if(conn_parse_number(line, len, TAIL_COMMAND, &value)){
+        return conn_send_tail(conn, value);
+    }
+
+    if(conn_parse_number(line, len, DELTA_COMMAND, &value)){
+        conn->delta = value != 0;
+        // Catch up right away, later packets continue from here
+        return conn->delta ? conn_send_tail(conn, conn->readback_end) : 0;
+    }
+
+    if(conn_line_is(line, len, FRAME_NEGOTIATE)){
+        // Everything after this line is framed
+        AESD_LOG(LOG_DEBUG, "Switching connection to binary frames");
+        conn->binary = true;
+        return conn_send(conn, FRAME_NEGOTIATE_ACK, strlen(FRAME_NEGOTIATE_ACK));
+    }
+
+    if(conn_parse_seek(line, len, &seekto)){
+        AESD_LOG(LOG_DEBUG, "=== SEEK COMMAND DETECTED ===");
+        metrics_inc(METRIC_SEEKS);
+#ifdef USE_AESD_CHAR_DEVICE
+        if(conn->ops->seek_readback(conn, &seekto) == -1){
+            return -1;
+        }
+        return conn->tx_overflow ? -1 : 0;
+#else
+        // Kept as data in file mode, like any other packet
+        conn->ops->seek_readback(conn, &seekto);
+#endif
+    }
+
+    if(conn_append(conn, line, len, true) == -1){
+        return -1;
+    }
+    metrics_inc(METRIC_PACKETS);
+    // The readback helpers stop on a failed send without reporting it
+    return conn->tx_overflow ? -1 : 0;
+}
+
+ssize_t conn_recv(struct aesd_conn *conn, char *buf, size_t cap)
+{
+    size_t want = conn->recv_size < cap ? conn->recv_size : cap;
+    ssize_t received = recv(conn->client_fd, buf, want, 0);
+
+    // A full buffer means more is likely queued, a mostly empty one that the
+    // burst is over
+    if(received > 0 && (size_t)received == want && conn->recv_size < buffer_max){
+        conn->recv_size = conn->recv_size * 2 < buffer_max ? conn->recv_size * 2 : buffer_max;
+    } else if(received >= 0 && (size_t)received < conn->recv_size / 4 && conn->recv_size > BUFFER_SIZE){
+        conn->recv_size /= 2;
+    }
+    return received;
+}
+
+// Send the header of a response frame with a @param len byte payload
+static int conn_frame_header(struct aesd_conn *conn, uint8_t op, uint8_t status, size_t len)
+{
+    struct aesd_frame_header header = {
+        .op = op,
+        .status = status,
+        .length = htonl(len),
+    };
+
+    return conn_send(conn, (const char *)&header, sizeof(header));
+}
+
+// Send one response frame carrying the @param len bytes at @param data
+static int conn_frame_reply(struct aesd_conn *conn, uint8_t op, uint8_t status,
+                            const char *data, size_t len)
+{
+    if(conn_frame_header(conn, op, status, len) == -1){
+        return -1;
+    }
+    return len > 0 ? conn_send(conn, data, len) : 0;
+}
+
+#ifdef USE_AESD_CHAR_DEVICE
+// Reply to @param op with the history from the current position
+static int conn_frame_history(struct aesd_conn *conn, uint8_t op)
+{
+    struct readback_snapshot *snap = readback_cache_get();
+
+    if(!snap){
+        return conn_frame_reply(conn, op, FRAME_EIO, NULL, 0);
+    }
+    off_t pos = lseek(conn->data_fd, 0, SEEK_CUR);
+    size_t len = pos >= 0 && pos < (off_t)snap->len ? snap->len - pos : 0;
+    int rc = conn_frame_reply(conn, op, FRAME_OK, snap->data + snap->len - len, len);
+    readback_cache_put(snap);
+    return rc;
+}
+#else
+// Reply to @param op with the whole history, snapshotted like a text readback
+static int conn_frame_history(struct aesd_conn *conn, uint8_t op)
+{
+    int data_fd = mmap_log_active() ? mmap_log_fd() : conn->data_fd;
+    off_t size = conn_history_size(conn);
+
+    if(size == -1){
+        return conn_frame_reply(conn, op, FRAME_EIO, NULL, 0);
+    }
+
+    if(conn_frame_header(conn, op, FRAME_OK, size) == -1){
+        return -1;
+    }
+    // A short readback would desynchronize the stream
+    return conn_readback_file(conn, data_fd, 0, size) == size ? 0 : -1;
+}
+#endif
+
+// Handle one request frame, @return 0 to keep the connection, -1 to close
+static int conn_handle_frame(struct aesd_conn *conn, uint8_t op, const char *payload, size_t len)
+{
+    uint64_t start;
+
+    switch(op){
+        case FRAME_APPEND: {
+            // Written whole, the newline only decides whether a readback follows
+            if(conn_append(conn, payload, len, false) == -1){
+                return conn_frame_reply(conn, op, FRAME_EIO, NULL, 0);
+            }
+            if(len == 0 || payload[len - 1] != '\n'){
+                return conn_frame_reply(conn, op, FRAME_OK, NULL, 0);
+            }
+            metrics_inc(METRIC_PACKETS);
+            start = metrics_now();
+#ifdef USE_AESD_CHAR_DEVICE
+            off_t current_pos = lseek(conn->data_fd, 0, SEEK_CUR);
+            lseek(conn->data_fd, 0, SEEK_SET);
+            int rc = conn_frame_history(conn, op);
+            lseek(conn->data_fd, current_pos, SEEK_SET);
+#else
+            int rc = conn_frame_history(conn, op);
+#endif
+            metrics_observe(HIST_READBACK, start);
+            return rc;
+        }
+
+        case FRAME_SEEK_READ: {
+            struct aesd_frame_seek seek;
+
+            if(len != sizeof(seek)){
+                return conn_frame_reply(conn, op, FRAME_EINVAL, NULL, 0);
+            }
+            metrics_inc(METRIC_SEEKS);
+#ifdef USE_AESD_CHAR_DEVICE
+            memcpy(&seek, payload, sizeof(seek));
+            struct aesd_seekto seekto = {
+                .write_cmd = ntohl(seek.write_cmd),
+                .write_cmd_offset = ntohl(seek.write_cmd_offset),
+            };
+            if(ioctl(conn->data_fd, AESDCHAR_IOCSEEKTO, &seekto) == -1){
+                AESD_LOG(LOG_DEBUG, "ioctl seek failed: %m");
+                return conn_frame_reply(conn, op, FRAME_EINVAL, NULL, 0);
+            }
+            start = metrics_now();
+            int rc = conn_frame_history(conn, op);
+            metrics_observe(HIST_READBACK, start);
+            return rc;
+#else
+            return conn_frame_reply(conn, op, FRAME_ENOTSUP, NULL, 0);
+#endif
+        }
+
+        case FRAME_STATS: {
+            size_t text_len;
+            char *text = metrics_render(&text_len);
+            if(!text){
+                return conn_frame_reply(conn, op, FRAME_EIO, NULL, 0);
+            }
+            int rc = conn_frame_reply(conn, op, FRAME_OK, text, text_len);
+            free(text);
+            return rc;
+        }
+
+        default:
+            return conn_frame_reply(conn, op, FRAME_ENOTSUP, NULL, 0);
+    }
+}
+
+/**
+ * Handle every complete frame at the start of the @param len bytes at
+ * @param data, no byte of a payload is looked at to find its end.
+ * @return the bytes consumed, -1 to close the connection.
+ */
+static ssize_t conn_handle_frames(struct aesd_conn *conn, const char *data, size_t len)
+{
+    struct aesd_frame_header header;
+    size_t consumed = 0;
+
+    while(len - consumed >= sizeof(header)){
+        memcpy(&header, data + consumed, sizeof(header));
+        size_t payload_len = ntohl(header.length);
+
+        if(payload_len > FRAME_PAYLOAD_MAX){
+            AESD_LOG(LOG_WARNING, "Frame of %zu bytes over the limit, closing", payload_len);
+            return -1;
+        }
+        if(len - consumed - sizeof(header) < payload_len){
+            break;
+        }
+        if(conn_handle_frame(conn, header.op, data + consumed + sizeof(header), payload_len) == -1){
+            return -1;
+        }
+        consumed += sizeof(header) + payload_len;
+    }
+    return conn->tx_overflow ? -1 : (ssize_t)consumed;
+}
+
+int conn_handle_data(struct aesd_conn *conn, const char *buf, size_t len)
+{
+    const char *data = buf;
+    size_t data_len = len;
+    size_t consumed = 0;
+    const char *newline;
+
+    AESD_LOG(LOG_DEBUG, "Received %zu bytes: %.*s", len, (int)len, buf);
+    metrics_add(METRIC_BYTES_IN, len);
+
+    // Continue a command split across chunks, otherwise frame in place
+    if(conn->rx_len > 0){
+        if(conn_rx_reserve(conn, len) == -1){
+            return -1;
+        }
+        memcpy(conn->rx_buf + conn->rx_len, buf, len);
+        conn->rx_len += len;
+        data = conn->rx_buf;
+        data_len = conn->rx_len;
+    }
+
+    // memchr is the vectorized newline scan, glibc uses SSE2/AVX2 for it
+    while(!conn->binary && !conn->subscribed && (newline = memchr(data + consumed, '\n', data_len - consumed)) != NULL){
+        size_t line_len = newline - (data + consumed) + 1;
+
+        if(conn_handle_line(conn, data + consumed, line_len) == -1){
+            return -1;
+        }
+        consumed += line_len;
+    }
+
+    if(conn->subscribed){
+        // A watcher only receives
+        consumed = data_len;
+    } else if(conn->binary){
+        ssize_t framed = conn_handle_frames(conn, data + consumed, data_len - consumed);
+        if(framed == -1){
+            return -1;
+        }
+        consumed += framed;
+    } else if(data_len - consumed >= RX_PARTIAL_MAX){
+        // A tail this long cannot be a command, let the driver assemble it
+        if(conn_append(conn, data + consumed, data_len - consumed, false) == -1){
+            return -1;
+        }
+        consumed = data_len;
+    }
+
+    // Keep the incomplete tail for the next chunk
+    if(data == conn->rx_buf){
+        memmove(conn->rx_buf, conn->rx_buf + consumed, data_len - consumed);
+        conn->rx_len = data_len - consumed;
+    } else if(consumed < data_len){
+        if(conn_rx_reserve(conn, data_len - consumed) == -1){
+            return -1;
+        }
+        memcpy(conn->rx_buf, data + consumed, data_len - consumed);
+        conn->rx_len = data_len - consumed;
+    }
+
+    // Readback that did not fit in the socket has to drain before more input
+    if(conn_tx_pending(conn)){
+        conn->state = CONN_WRITING;
+    }
+    return 0;
+}
+
+void conn_finish(struct aesd_conn *conn)
+{
+    // A truncated frame is dropped, it was never a request
+    if(conn->rx_len > 0 && !conn->binary){
+        conn_append(conn, conn->rx_buf, conn->rx_len, false);
+        conn->rx_len = 0;
+    }
+}
+
+void conn_serve(struct aesd_conn *conn)
+{
+    char *buffer = NULL;
+    size_t cap = 0;
+    ssize_t bytes_received;
+
+    if(io_backend == IO_URING && uring_serve(conn) == 0){
+        return;
+    }
+
+    if(conn_buf_size(&buffer, &cap, BUFFER_SIZE) == 0){
+        AESD_LOG(LOG_ERR, "Failed to allocate recv buffer");
+        return;
+    }
+
+    // Receive data from client, growing the buffer along with the recv size
+    while((bytes_received = conn_recv(conn, buffer, conn_buf_size(&buffer, &cap, conn->recv_size))) > 0){
+        if(conn_handle_data(conn, buffer, bytes_received) == -1){
+            break;
+        }
+        if(conn->shm){
+            // The ring and the socket are waited on together from now on
+            bytes_received = shm_session_serve(conn->shm, conn, buffer, cap);
+            break;
+        }
+    }
+    free(buffer);
+
+    if(bytes_received == -1){
+        AESD_LOG(LOG_ERR, "recv failed: %m");
+    } else if(bytes_received == 0){
+        AESD_LOG(LOG_DEBUG, "Client disconnected");
+        conn_finish(conn);
+    }
+}
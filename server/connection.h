@@ -0,0 +1,263 @@
+/*
+ * connection.h
+ *
+ *  Per-connection state machine shared by every aesdsocket serving mode.
+ *
+ *  A connection owns the client socket and its own descriptor on OUTPUT_FILE.
+ *  Received bytes are fed through conn_handle_data(), a streaming framer that
+ *  splits them into newline terminated commands, carrying an incomplete tail
+ *  over to the next chunk, or once a client negotiates it into the binary
+ *  frames of aesd_frame.h.  Each command is either a seek request or a packet
+ *  that is written to the device/file and answered with the history readback.
+ *  The device side goes through struct conn_ops so the sync and io_uring data
+ *  paths share the framing.  In blocking mode the readback is sent inline; in
+ *  non-blocking mode whatever the socket won't take right away is kept in the
+ *  tx queue until conn_flush() drains it.  Open connections are registered
+ *  so shutdown can wake threads blocked on them without any polling.
+ *
+ *  Admission: every accepted socket takes a slot with conn_admit() and gives
+ *  it back through conn_close(), or conn_drop() if it is disposed of before a
+ *  connection is set up, so the number of sockets held never exceeds the
+ *  configured limit.
+ */
+
+#ifndef AESDSOCKET_CONNECTION_H
+#define AESDSOCKET_CONNECTION_H
+
+#include "stdbool.h"
+#include "stddef.h"
+#include "sys/types.h"
+#include "queue.h"
+#include "aesd_ioctl.h"
+
+// A partial line is handed to the device in pieces once it grows this large
+#define RX_PARTIAL_MAX (64 * 1024)
+
+// "AESDCHAR_TAIL:<offset>" sends the history from byte <offset> on.  On the
+// char device offsets count every byte ever stored, evicted ones included,
+// an offset no longer held gets everything still held.
+#define TAIL_COMMAND "AESDCHAR_TAIL:"
+// "AESDCHAR_DELTA:1" makes packet readbacks carry only what is new since the
+// last readback, and sends what is new right away; "AESDCHAR_DELTA:0" goes
+// back to whole history readbacks
+#define DELTA_COMMAND "AESDCHAR_DELTA:"
+
+// Default cap on the adaptive recv size and readback buffer of a connection
+#define CONN_BUFFER_MAX (256 * 1024)
+
+enum conn_state {
+    CONN_READING,   // Waiting for data from the client
+    CONN_WRITING,   // Readback queued, waiting for the socket to drain
+    CONN_CLOSING,   // Client is done, flush what is left then close
+};
+
+struct aesd_conn;
+struct shm_session;
+
+// Device/file side of a connection
+struct conn_ops {
+    /**
+     * Write @param len bytes to the data descriptor.  When @param complete is
+     * set they end a packet and the whole history is sent back.
+     * @return 0 on success, -1 if the connection has to be closed.
+     */
+    int (*append)(struct aesd_conn *conn, const char *data, size_t len, bool complete);
+    /**
+     * Apply @param seekto and send the history from the new position.
+     * @return 0 on success (a rejected seek included), -1 to close.
+     */
+    int (*seek_readback)(struct aesd_conn *conn, const struct aesd_seekto *seekto);
+};
+
+struct aesd_conn {
+    int client_fd;
+    int data_fd;
+    bool nonblocking;
+    enum conn_state state;
+
+    const struct conn_ops *ops;
+    // Backend private state, the io_uring ring for instance
+    void *io_ctx;
+
+    // Bytes asked of the next recv, doubled while recvs fill it and halved
+    // while they come back mostly empty, between BUFFER_SIZE and the cap
+    size_t recv_size;
+
+    // Readback bounce buffer, sized to the history up to the cap
+    char *rb_buf;
+    size_t rb_cap;
+
+    // Incomplete command carried over between chunks
+    char *rx_buf;
+    size_t rx_len;
+    size_t rx_cap;
+
+    // Bytes accepted for the client but not yet taken by the socket
+    char *tx_buf;
+    size_t tx_len;
+    size_t tx_off;
+    size_t tx_cap;
+    // The tx queue hit the in-flight limit, the connection has to be closed
+    bool tx_overflow;
+
+    // Negotiated the length-prefixed frames of aesd_frame.h
+    bool binary;
+
+    // End of the history as of the last text readback, where a delta
+    // readback starts.  On the char device this is a stream offset, see
+    // readback_cache.h, so it stays put as old entries are evicted.
+    off_t readback_end;
+    bool delta;
+
+    // Watching through fanout.h, which sends to the socket from then on
+    bool subscribed;
+
+    // Shared memory ring of shm_ring.h, once negotiated
+    struct shm_session *shm;
+
+    // Registry of open connections, woken by conn_shutdown_all()
+    LIST_ENTRY(aesd_conn) live;
+};
+
+/**
+ * Set the admission limits, 0 for none: @param max_conns client sockets held
+ * at once, @param max_inflight bytes queued for a client that is not reading.
+ * Call before the first connection is accepted.
+ * @return 0 on success, -1 if the slot notification could not be set up.
+ */
+int conn_set_limits(long max_conns, size_t max_inflight);
+
+/**
+ * Cap the adaptive recv size and readback buffer of every connection at
+ * @param max bytes, BUFFER_SIZE at least.  Call before serving starts.
+ */
+void conn_set_buffer_max(size_t max);
+
+/**
+ * @return the current cap, the largest buffer conn_recv() will fill.
+ */
+size_t conn_buffer_max(void);
+
+/**
+ * Take a slot for a newly accepted socket.
+ * @return true if admitted, false when max_conns sockets are already held.
+ */
+bool conn_admit(void);
+
+/**
+ * @return an eventfd that becomes readable when a slot is given back after
+ * the limit was reached, -1 without a connection limit.  Non-blocking, read
+ * it to rearm.
+ */
+int conn_admit_fd(void);
+
+/**
+ * Close an admitted @param client_fd that never made it to conn_open(), or
+ * whose conn_open() failed, and give its slot back.
+ */
+void conn_drop(int client_fd);
+
+/**
+ * Set up @param conn for @param client_fd and open the data descriptor.
+ * @return 0 on success, -1 if OUTPUT_FILE could not be opened.  The client
+ * socket is left open on failure, the caller decides how to dispose of it.
+ */
+int conn_open(struct aesd_conn *conn, int client_fd, bool nonblocking);
+
+/**
+ * Close both descriptors, release the rx and tx buffers and give the
+ * admission slot back.
+ */
+void conn_close(struct aesd_conn *conn);
+
+/**
+ * Shut down the socket of every open connection, and of any opened later, so
+ * whatever is blocked on a client (recv, send, sendfile, io_uring) returns.
+ */
+void conn_shutdown_all(void);
+
+/**
+ * recv(2) from the client into @param buf of @param cap bytes, asking for as
+ * much as the connection's adaptive recv size, and adapt that size to the
+ * result.  @return what recv returned, errno is left as recv set it.
+ */
+ssize_t conn_recv(struct aesd_conn *conn, char *buf, size_t cap);
+
+/**
+ * Write @param len bytes through the connection's data path like
+ * conn_ops.append, which pushes them to subscribers under file_mutex along
+ * with the write, so watchers see the history in the order it is stored.
+ * @return 0 on success, -1 if the connection has to be closed.
+ */
+int conn_append(struct aesd_conn *conn, const char *data, size_t len, bool complete);
+
+#ifdef USE_AESD_CHAR_DEVICE
+/**
+ * Send the readback after a packet from the shared snapshot of
+ * readback_cache.h: the whole history, or in delta mode what is new since
+ * the last readback.
+ * @return 0, or -1 if the connection has to be closed.
+ */
+int conn_readback_packet(struct aesd_conn *conn);
+#endif
+
+/**
+ * Frame one chunk received from the client and handle every complete
+ * command in it, in order.
+ * @return 0 to keep the connection, -1 when it has to be closed.
+ */
+int conn_handle_data(struct aesd_conn *conn, const char *buf, size_t len);
+
+/**
+ * The client closed its side: hand an unterminated tail to the device so
+ * the driver keeps it as a partial write, like the data it follows.
+ */
+void conn_finish(struct aesd_conn *conn);
+
+/**
+ * Recognize an "AESDCHAR_IOCSEEKTO:<cmd>,<offset>" command in the
+ * @param len bytes at @param line.
+ * @return true and fill @param seekto if it is a valid seek command.
+ */
+bool conn_parse_seek(const char *line, size_t len, struct aesd_seekto *seekto);
+
+/**
+ * Send @param data to the client, queueing whatever a non-blocking socket
+ * does not accept.  @return 0 on success, -1 on a send or allocation error.
+ */
+int conn_send(struct aesd_conn *conn, const char *data, size_t len);
+
+/**
+ * Push queued bytes to the socket.
+ * @return 1 when the queue is empty, 0 if bytes remain, -1 on error.
+ */
+int conn_flush(struct aesd_conn *conn);
+
+/**
+ * @return where the readback after a packet starts, with the history now
+ * holding stream offsets @param base to @param end: its start, or in delta
+ * mode the end of the last readback.  A position since evicted, or past the
+ * end after the device was reloaded, gets the whole history again rather
+ * than risk skipping part of it.
+ */
+static inline off_t conn_readback_start(const struct aesd_conn *conn, off_t base, off_t end)
+{
+    if(!conn->delta || conn->readback_end < base || conn->readback_end > end){
+        return base;
+    }
+    return conn->readback_end;
+}
+
+static inline bool conn_tx_pending(const struct aesd_conn *conn)
+{
+    return conn->tx_off < conn->tx_len;
+}
+
+/**
+ * Blocking recv loop used by the thread and pool modes, through io_uring when
+ * that backend is selected.  Returns once the client disconnects or an error
+ * ends the connection.
+ */
+void conn_serve(struct aesd_conn *conn);
+
+#endif /* AESDSOCKET_CONNECTION_H */
@@ -0,0 +1,292 @@
+#define _DEFAULT_SOURCE
+#include "sys/socket.h"
+#include "sys/types.h"
+#include "sys/epoll.h"
+#include "syslog.h"
+#include "unistd.h"
+#include "fcntl.h"
+#include "string.h"
+#include "stdlib.h"
+#include "errno.h"
+#include "stdbool.h"
+#include "stdint.h"
+#include "pthread.h"
+#include "queue.h"
+#include "aesdsocket.h"
+#include "connection.h"
+#include "event_loop.h"
+#include "aesdlog.h"
+
+#define MAX_EVENTS 64
+
+struct event_loop;
+
+// Connection owned by one loop, kept on its list so shutdown can close it
+struct loop_conn {
+    struct aesd_conn conn;
+    struct event_loop *loop;
+    uint32_t events;
+    LIST_ENTRY(loop_conn) entries;
+};
+
+struct event_loop {
+    int epoll_fd;
+    pthread_t thread_id;
+    // Protects conns, the accepting thread inserts while the loop removes
+    pthread_mutex_t lock;
+    LIST_HEAD(loop_conn_list, loop_conn) conns;
+};
+
+static struct event_loop *loops;
+static int loop_count;
+static unsigned next_loop;
+
+static void loop_conn_close(struct loop_conn *lc)
+{
+    struct event_loop *loop = lc->loop;
+
+    pthread_mutex_lock(&loop->lock);
+    LIST_REMOVE(lc, entries);
+    pthread_mutex_unlock(&loop->lock);
+
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, lc->conn.client_fd, NULL);
+    conn_close(&lc->conn);
+    free(lc);
+}
+
+// Register interest matching the connection state, or close it once done
+static void loop_conn_update(struct loop_conn *lc)
+{
+    uint32_t events;
+
+    switch(lc->conn.state){
+        case CONN_READING:
+            events = EPOLLIN;
+            break;
+        case CONN_WRITING:
+            events = EPOLLOUT;
+            break;
+        case CONN_CLOSING:
+        default:
+            if(!conn_tx_pending(&lc->conn)){
+                AESD_LOG(LOG_DEBUG, "Client disconnected");
+                loop_conn_close(lc);
+                return;
+            }
+            events = EPOLLOUT;
+            break;
+    }
+
+    if(events != lc->events){
+        struct epoll_event ev;
+        ev.events = events;
+        ev.data.ptr = lc;
+        if(epoll_ctl(lc->loop->epoll_fd, EPOLL_CTL_MOD, lc->conn.client_fd, &ev) == -1){
+            AESD_LOG(LOG_ERR, "epoll_ctl modify failed: %m");
+            loop_conn_close(lc);
+            return;
+        }
+        lc->events = events;
+    }
+}
+
+static void loop_conn_readable(struct loop_conn *lc, char *buffer, size_t cap)
+{
+    ssize_t bytes_received = conn_recv(&lc->conn, buffer, cap);
+
+    if(bytes_received > 0){
+        if(conn_handle_data(&lc->conn, buffer, bytes_received) == -1){
+            loop_conn_close(lc);
+            return;
+        }
+    } else if(bytes_received == 0){
+        conn_finish(&lc->conn);
+        lc->conn.state = CONN_CLOSING;
+    } else {
+        if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR){
+            return;
+        }
+        AESD_LOG(LOG_ERR, "recv failed: %m");
+        loop_conn_close(lc);
+        return;
+    }
+
+    loop_conn_update(lc);
+}
+
+static void loop_conn_writable(struct loop_conn *lc)
+{
+    int rc = conn_flush(&lc->conn);
+
+    if(rc == -1){
+        loop_conn_close(lc);
+        return;
+    }
+    if(rc == 1 && lc->conn.state == CONN_WRITING){
+        lc->conn.state = CONN_READING;
+    }
+
+    loop_conn_update(lc);
+}
+
+static void *event_loop_thread_func(void *arg)
+{
+    struct event_loop *loop = (struct event_loop *)arg;
+    struct epoll_event events[MAX_EVENTS];
+    // Shared by every connection on this loop, chunks are handled
+    // synchronously.  Sized for the largest recv so each connection only
+    // keeps its adaptive recv size.
+    size_t cap = conn_buffer_max();
+    char *buffer = malloc(cap);
+    if(!buffer){
+        AESD_LOG(LOG_WARNING, "Failed to allocate %zu byte recv buffer", cap);
+        cap = BUFFER_SIZE;
+        buffer = malloc(cap);
+        if(!buffer){
+            AESD_LOG(LOG_ERR, "Failed to allocate event loop recv buffer");
+            pthread_exit(NULL);
+        }
+    }
+
+    while(!exit_flag){
+        int nfds = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, -1);
+        if(nfds == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            AESD_LOG(LOG_ERR, "epoll_wait failed: %m");
+            break;
+        }
+
+        for(int i = 0; i < nfds; i++){
+            struct loop_conn *lc = (struct loop_conn *)events[i].data.ptr;
+
+            if(!lc){
+                // shutdown_fd, exit_flag is set
+                continue;
+            }
+            if(events[i].events & EPOLLERR){
+                loop_conn_close(lc);
+            } else if(events[i].events & EPOLLOUT){
+                loop_conn_writable(lc);
+            } else if(events[i].events & (EPOLLIN | EPOLLHUP)){
+                // A hangup reads as end of stream through recv
+                loop_conn_readable(lc, buffer, cap);
+            }
+        }
+    }
+
+    free(buffer);
+
+    // Connections left open are closed by event_loops_stop() once the
+    // accepting thread can no longer add to the list
+    pthread_exit(NULL);
+}
+
+int event_loops_start(int count)
+{
+    loops = calloc(count, sizeof(struct event_loop));
+    if(!loops){
+        AESD_LOG(LOG_ERR, "Failed to allocate event loops");
+        return -1;
+    }
+
+    for(int i = 0; i < count; i++){
+        struct event_loop *loop = &loops[i];
+
+        LIST_INIT(&loop->conns);
+        pthread_mutex_init(&loop->lock, NULL);
+
+        loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if(loop->epoll_fd == -1){
+            AESD_LOG(LOG_ERR, "epoll_create1 failed: %m");
+            break;
+        }
+        // Never read, stays readable once shutdown starts and wakes every loop
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+        if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, shutdown_fd, &ev) == -1){
+            AESD_LOG(LOG_ERR, "Failed to watch shutdown eventfd: %m");
+            close(loop->epoll_fd);
+            break;
+        }
+        if(pthread_create(&loop->thread_id, NULL, event_loop_thread_func, loop) != 0){
+            AESD_LOG(LOG_ERR, "Failed to create event loop thread");
+            close(loop->epoll_fd);
+            break;
+        }
+        loop_count++;
+    }
+
+    if(loop_count == 0){
+        free(loops);
+        loops = NULL;
+        return -1;
+    }
+    if(loop_count < count){
+        AESD_LOG(LOG_WARNING, "Started %d of %d event loops", loop_count, count);
+    }
+    AESD_LOG(LOG_INFO, "Serving connections from %d event loops", loop_count);
+    return 0;
+}
+
+int event_loops_dispatch(int client_fd)
+{
+    // Acceptor threads dispatch concurrently
+    struct event_loop *loop = &loops[__atomic_fetch_add(&next_loop, 1, __ATOMIC_RELAXED) % loop_count];
+
+    int flags = fcntl(client_fd, F_GETFL);
+    if(flags == -1 || fcntl(client_fd, F_SETFL, flags | O_NONBLOCK) == -1){
+        AESD_LOG(LOG_ERR, "Failed to make client socket non-blocking: %m");
+        conn_drop(client_fd);
+        return -1;
+    }
+
+    struct loop_conn *lc = malloc(sizeof(struct loop_conn));
+    if(!lc){
+        AESD_LOG(LOG_ERR, "Failed to allocate connection");
+        conn_drop(client_fd);
+        return -1;
+    }
+    if(conn_open(&lc->conn, client_fd, true) == -1){
+        free(lc);
+        conn_drop(client_fd);
+        return -1;
+    }
+    lc->loop = loop;
+    lc->events = EPOLLIN;
+
+    pthread_mutex_lock(&loop->lock);
+    LIST_INSERT_HEAD(&loop->conns, lc, entries);
+    pthread_mutex_unlock(&loop->lock);
+
+    struct epoll_event ev;
+    ev.events = lc->events;
+    ev.data.ptr = lc;
+    if(epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) == -1){
+        AESD_LOG(LOG_ERR, "epoll_ctl add failed: %m");
+        loop_conn_close(lc);
+        return -1;
+    }
+
+    return 0;
+}
+
+void event_loops_stop(void)
+{
+    for(int i = 0; i < loop_count; i++){
+        struct event_loop *loop = &loops[i];
+        struct loop_conn *lc;
+
+        pthread_join(loop->thread_id, NULL);
+
+        // Drop whatever is still connected
+        while((lc = LIST_FIRST(&loop->conns)) != NULL){
+            loop_conn_close(lc);
+        }
+        close(loop->epoll_fd);
+        pthread_mutex_destroy(&loop->lock);
+    }
+    free(loops);
+    loops = NULL;
+    loop_count = 0;
+}
@@ -0,0 +1,31 @@
+/*
+ * event_loop.h
+ *
+ *  Event-driven serving mode: a fixed set of epoll threads, each multiplexing
+ *  many non-blocking connections through the struct aesd_conn state machine.
+ */
+
+#ifndef AESDSOCKET_EVENT_LOOP_H
+#define AESDSOCKET_EVENT_LOOP_H
+
+/**
+ * Start @param count event loop threads.
+ * @return 0 on success, -1 if no loop could be started.
+ */
+int event_loops_start(int count);
+
+/**
+ * Hand an accepted @param client_fd to the next loop (round robin).  The fd is
+ * switched to non-blocking and owned by the loop from here on, it is closed
+ * on failure.  Safe to call from several acceptor threads.
+ * @return 0 on success, -1 on failure.
+ */
+int event_loops_dispatch(int client_fd);
+
+/**
+ * Wait for every loop to be woken by shutdown_fd and exit, then close the
+ * connections they still held.
+ */
+void event_loops_stop(void);
+
+#endif /* AESDSOCKET_EVENT_LOOP_H */
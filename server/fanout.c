@@ -0,0 +1,331 @@
+#define _GNU_SOURCE
+#include "sys/socket.h"
+#include "sys/types.h"
+#include "sys/epoll.h"
+#include "sys/eventfd.h"
+#include "syslog.h"
+#include "unistd.h"
+#include "string.h"
+#include "stdlib.h"
+#include "stdint.h"
+#include "errno.h"
+#include "stdbool.h"
+#include "pthread.h"
+#include "queue.h"
+#include "connection.h"
+#include "fanout.h"
+#include "metrics.h"
+#include "aesdlog.h"
+
+// Epoll key of the stop eventfd, subscribers count from 1
+#define STOP_ID 0
+#define FANOUT_EVENTS 16
+
+struct subscriber {
+    struct aesd_conn *conn;
+    int fd;                 // The connection's socket, closed by conn_close()
+    uint64_t id;            // Epoll key, unlike fds never reused
+    char *buf;              // Bytes the socket refused, from off to len
+    size_t off;
+    size_t len;
+    size_t cap;
+    bool closing;           // Disconnected as a slow consumer
+    LIST_ENTRY(subscriber) entries;
+};
+
+static struct {
+    pthread_mutex_t lock;   // Protects the list and every subscriber in it
+    LIST_HEAD(, subscriber) subs;
+    unsigned long count;    // Atomic, lets publishers skip the lock
+    uint64_t next_id;
+    size_t queue_max;
+    enum fanout_policy policy;
+    int epoll_fd;
+    int stop_fd;
+    pthread_t thread_id;
+    bool running;
+} fan = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .subs = LIST_HEAD_INITIALIZER(fan.subs),
+    .next_id = STOP_ID + 1,
+    .epoll_fd = -1,
+    .stop_fd = -1,
+};
+
+static size_t sub_queued(const struct subscriber *sub)
+{
+    return sub->len - sub->off;
+}
+
+// Wake the thread once the socket of @param sub takes more, called with lock
+static void sub_arm(struct subscriber *sub)
+{
+    struct epoll_event ev = { .events = EPOLLOUT | EPOLLONESHOT, .data.u64 = sub->id };
+
+    if(epoll_ctl(fan.epoll_fd, EPOLL_CTL_MOD, sub->fd, &ev) == -1){
+        AESD_LOG(LOG_ERR, "Failed to watch subscriber fd %d: %m", sub->fd);
+    }
+}
+
+/**
+ * Send what the socket of @param sub takes without blocking, called with lock.
+ * @return the bytes sent, -1 once the client is gone.
+ */
+static ssize_t sub_send(struct subscriber *sub, const char *data, size_t len)
+{
+    size_t total_sent = 0;
+
+    while(total_sent < len){
+        ssize_t sent = send(sub->fd, data + total_sent, len - total_sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if(sent == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                break;
+            }
+            // The connection notices on its own and unsubscribes
+            AESD_LOG(LOG_DEBUG, "Push to subscriber fd %d failed: %m", sub->fd);
+            sub->closing = true;
+            return -1;
+        }
+        total_sent += sent;
+    }
+    metrics_add(METRIC_BYTES_OUT, total_sent);
+    return total_sent;
+}
+
+// Queue @param len bytes for @param sub, called with lock
+static int sub_queue(struct subscriber *sub, const char *data, size_t len)
+{
+    if(sub->off > 0){
+        memmove(sub->buf, sub->buf + sub->off, sub_queued(sub));
+        sub->len -= sub->off;
+        sub->off = 0;
+    }
+    if(sub->len + len > sub->cap){
+        size_t new_cap = sub->cap ? sub->cap : 1024;
+        while(new_cap < sub->len + len){
+            new_cap *= 2;
+        }
+        char *new_buf = realloc(sub->buf, new_cap);
+        if(!new_buf){
+            AESD_LOG(LOG_ERR, "Failed to grow subscriber queue to %zu bytes", new_cap);
+            return -1;
+        }
+        sub->buf = new_buf;
+        sub->cap = new_cap;
+    }
+    memcpy(sub->buf + sub->len, data, len);
+    sub->len += len;
+    return 0;
+}
+
+// Push to one subscriber, called with lock
+static void sub_push(struct subscriber *sub, const char *data, size_t len)
+{
+    ssize_t sent = 0;
+
+    if(sub->closing){
+        return;
+    }
+    // An empty queue always takes a push, however long
+    if(sub_queued(sub) > 0 && sub_queued(sub) + len > fan.queue_max){
+        if(fan.policy == FANOUT_DROP){
+            metrics_inc(METRIC_SUB_DROPPED);
+            return;
+        }
+        AESD_LOG(LOG_INFO, "Disconnecting slow subscriber fd %d", sub->fd);
+        metrics_inc(METRIC_SUB_DISCONNECTED);
+        sub->closing = true;
+        shutdown(sub->fd, SHUT_RDWR);
+        return;
+    }
+
+    // Queued bytes have to go first to keep ordering
+    if(sub_queued(sub) == 0){
+        sent = sub_send(sub, data, len);
+        if(sent == -1){
+            return;
+        }
+    }
+    metrics_inc(METRIC_SUB_PUSHED);
+    if((size_t)sent < len){
+        bool was_empty = sub_queued(sub) == 0;
+        if(sub_queue(sub, data + sent, len - sent) == -1){
+            metrics_inc(METRIC_SUB_DROPPED);
+        } else if(was_empty){
+            sub_arm(sub);
+        }
+    }
+}
+
+static void *fanout_thread_func(void *arg)
+{
+    struct epoll_event events[FANOUT_EVENTS];
+
+    while(true){
+        int count = epoll_wait(fan.epoll_fd, events, FANOUT_EVENTS, -1);
+        if(count == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            AESD_LOG(LOG_ERR, "Fanout epoll_wait failed: %m");
+            break;
+        }
+
+        pthread_mutex_lock(&fan.lock);
+        for(int i = 0; i < count; i++){
+            if(events[i].data.u64 == STOP_ID){
+                pthread_mutex_unlock(&fan.lock);
+                return NULL;
+            }
+            // Gone already if it unsubscribed since the event came in
+            struct subscriber *sub;
+            LIST_FOREACH(sub, &fan.subs, entries){
+                if(sub->id == events[i].data.u64){
+                    break;
+                }
+            }
+            if(!sub || sub->closing){
+                continue;
+            }
+            ssize_t sent = sub_send(sub, sub->buf + sub->off, sub_queued(sub));
+            if(sent == -1){
+                continue;
+            }
+            sub->off += sent;
+            if(sub_queued(sub) > 0){
+                sub_arm(sub);
+            } else {
+                sub->off = sub->len = 0;
+            }
+        }
+        pthread_mutex_unlock(&fan.lock);
+    }
+    return NULL;
+}
+
+int fanout_start(size_t queue_max, enum fanout_policy policy)
+{
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = STOP_ID };
+
+    fan.queue_max = queue_max;
+    fan.policy = policy;
+    fan.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    fan.stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if(fan.epoll_fd == -1 || fan.stop_fd == -1 ||
+       epoll_ctl(fan.epoll_fd, EPOLL_CTL_ADD, fan.stop_fd, &ev) == -1){
+        AESD_LOG(LOG_ERR, "Failed to set up fanout: %m");
+        goto fail;
+    }
+    if(pthread_create(&fan.thread_id, NULL, fanout_thread_func, NULL) != 0){
+        AESD_LOG(LOG_ERR, "Failed to create fanout thread");
+        goto fail;
+    }
+    fan.running = true;
+    return 0;
+
+fail:
+    if(fan.stop_fd != -1){
+        close(fan.stop_fd);
+        fan.stop_fd = -1;
+    }
+    if(fan.epoll_fd != -1){
+        close(fan.epoll_fd);
+        fan.epoll_fd = -1;
+    }
+    return -1;
+}
+
+int fanout_subscribe(struct aesd_conn *conn, const char *pending, size_t len)
+{
+    if(!fan.running){
+        return -1;
+    }
+    struct subscriber *sub = calloc(1, sizeof(*sub));
+    if(!sub){
+        AESD_LOG(LOG_ERR, "Failed to allocate subscriber");
+        return -1;
+    }
+    sub->conn = conn;
+    sub->fd = conn->client_fd;
+
+    pthread_mutex_lock(&fan.lock);
+    sub->id = fan.next_id++;
+    // One shot, a hung up socket is reported once rather than until it closes
+    struct epoll_event ev = { .events = EPOLLONESHOT, .data.u64 = sub->id };
+    if(epoll_ctl(fan.epoll_fd, EPOLL_CTL_ADD, sub->fd, &ev) == -1 ||
+       (len > 0 && sub_queue(sub, pending, len) == -1)){
+        AESD_LOG(LOG_ERR, "Failed to subscribe fd %d: %m", sub->fd);
+        epoll_ctl(fan.epoll_fd, EPOLL_CTL_DEL, sub->fd, NULL);
+        pthread_mutex_unlock(&fan.lock);
+        free(sub->buf);
+        free(sub);
+        return -1;
+    }
+    if(len > 0){
+        sub_arm(sub);
+    }
+    LIST_INSERT_HEAD(&fan.subs, sub, entries);
+    __atomic_add_fetch(&fan.count, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&fan.lock);
+
+    AESD_LOG(LOG_DEBUG, "Subscribed fd %d", sub->fd);
+    return 0;
+}
+
+void fanout_unsubscribe(struct aesd_conn *conn)
+{
+    struct subscriber *sub;
+
+    pthread_mutex_lock(&fan.lock);
+    LIST_FOREACH(sub, &fan.subs, entries){
+        if(sub->conn == conn){
+            break;
+        }
+    }
+    if(sub){
+        // Explicitly, epoll only forgets a socket once every fd on it is closed
+        epoll_ctl(fan.epoll_fd, EPOLL_CTL_DEL, sub->fd, NULL);
+        LIST_REMOVE(sub, entries);
+        __atomic_sub_fetch(&fan.count, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&fan.lock);
+
+    if(sub){
+        free(sub->buf);
+        free(sub);
+    }
+}
+
+void fanout_publish(const char *data, size_t len)
+{
+    struct subscriber *sub;
+
+    if(len == 0 || __atomic_load_n(&fan.count, __ATOMIC_ACQUIRE) == 0){
+        return;
+    }
+    pthread_mutex_lock(&fan.lock);
+    LIST_FOREACH(sub, &fan.subs, entries){
+        sub_push(sub, data, len);
+    }
+    pthread_mutex_unlock(&fan.lock);
+}
+
+void fanout_stop(void)
+{
+    uint64_t one = 1;
+
+    if(!fan.running){
+        return;
+    }
+    if(write(fan.stop_fd, &one, sizeof(one)) == -1){
+        AESD_LOG(LOG_ERR, "Failed to wake fanout thread: %m");
+    }
+    pthread_join(fan.thread_id, NULL);
+    fan.running = false;
+    close(fan.stop_fd);
+    close(fan.epoll_fd);
+    fan.stop_fd = fan.epoll_fd = -1;
+}
@@ -0,0 +1,66 @@
+/*
+ * fanout.h
+ *
+ *  Push of new history to subscribed connections.
+ *
+ *  A connection sending SUBSCRIBE_COMMAND becomes a watcher: from then on
+ *  whatever any client appends to the history is pushed to it, and anything
+ *  it sends is discarded.  Complete packets are pushed whole, a packet longer
+ *  than RX_PARTIAL_MAX in the pieces it was written in.  A publisher sends to
+ *  each subscriber right away with MSG_DONTWAIT and queues what the socket
+ *  refuses; a thread of its own drains the queues as sockets become
+ *  writable, so a writer never waits for a watcher.  A subscriber with
+ *  bytes queued that would go past the queue limit is a slow consumer: the
+ *  push is dropped for it, or it is disconnected, as the policy says.
+ */
+
+#ifndef AESDSOCKET_FANOUT_H
+#define AESDSOCKET_FANOUT_H
+
+#include "stddef.h"
+
+struct aesd_conn;
+
+// Command turning a connection into a watcher, for the rest of its life
+#define SUBSCRIBE_COMMAND "AESDCHAR_SUBSCRIBE"
+
+// Default limit on bytes queued for one subscriber
+#define FANOUT_QUEUE_MAX (1024 * 1024)
+
+// What happens to a subscriber that falls behind
+enum fanout_policy {
+    FANOUT_DROP,            // Skip pushes until its queue drains
+    FANOUT_DISCONNECT,      // Shut its connection down
+};
+
+/**
+ * Start the thread draining subscriber queues of up to @param queue_max
+ * bytes, slow consumers handled as @param policy says.
+ * @return 0 on success, -1 on failure (SUBSCRIBE_COMMAND is refused).
+ */
+int fanout_start(size_t queue_max, enum fanout_policy policy);
+
+/**
+ * Push everything published from now on to @param conn.  The @param len
+ * bytes at @param pending, still owed to the client, go out first.
+ * @return 0 on success, -1 on failure.
+ */
+int fanout_subscribe(struct aesd_conn *conn, const char *pending, size_t len);
+
+/**
+ * Stop pushing to @param conn, before its socket is closed.
+ */
+void fanout_unsubscribe(struct aesd_conn *conn);
+
+/**
+ * Push the @param len bytes at @param data, just appended to the history,
+ * to every subscriber.
+ */
+void fanout_publish(const char *data, size_t len);
+
+/**
+ * Stop the thread, once no subscriber is left.
+ */
+void fanout_stop(void);
+
+#endif /* AESDSOCKET_FANOUT_H */
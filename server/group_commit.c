@@ -0,0 +1,284 @@
+#define _GNU_SOURCE
+#include "sys/types.h"
+#include "sys/stat.h"
+#include "sys/uio.h"
+#include "syslog.h"
+#include "unistd.h"
+#include "fcntl.h"
+#include "limits.h"
+#include "errno.h"
+#include "stdbool.h"
+#include "pthread.h"
+#include "time.h"
+#include "aesdsocket.h"
+#include "group_commit.h"
+#include "fanout.h"
+#include "aesdlog.h"
+
+#ifndef USE_AESD_CHAR_DEVICE
+
+// Chunks gathered into one writev at most
+#define COMMIT_BATCH_MAX IOV_MAX
+
+// One queued chunk, lives on the stack of the writer waiting for it
+struct commit_req {
+    const char *data;
+    size_t len;
+    off_t end;                  // File size after this chunk, -1 on error
+    bool done;
+    struct commit_req *next;
+};
+
+static struct {
+    int data_fd;
+    enum commit_sync sync;
+    pthread_t thread_id;
+    bool active;
+
+    // FIFO of chunks waiting for the committer
+    struct commit_req *head;
+    struct commit_req *tail;
+    bool stopping;
+
+    pthread_mutex_t lock;
+    pthread_cond_t pending;     // Something was queued, or stop was asked
+    pthread_cond_t committed;   // A batch is done, its writers may return
+
+    bool dirty;                 // Written since the last fdatasync
+    struct timespec last_sync;
+} commit = {
+    .data_fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .pending = PTHREAD_COND_INITIALIZER,
+    .committed = PTHREAD_COND_INITIALIZER,
+};
+
+static void commit_sync_now(void)
+{
+    if(fdatasync(commit.data_fd) == -1){
+        AESD_LOG(LOG_ERR, "fdatasync failed: %m");
+    }
+    clock_gettime(CLOCK_MONOTONIC, &commit.last_sync);
+    commit.dirty = false;
+}
+
+static bool commit_sync_due(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - commit.last_sync.tv_sec) * 1000 +
+           (now.tv_nsec - commit.last_sync.tv_nsec) / 1000000 >= COMMIT_SYNC_INTERVAL_MS;
+}
+
+// writev the whole batch, resuming after short writes
+static ssize_t commit_writev(struct iovec *iov, int count)
+{
+    ssize_t total = 0;
+
+    while(count > 0){
+        ssize_t written = writev(commit.data_fd, iov, count);
+        if(written == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        total += written;
+        while(count > 0 && (size_t)written >= iov->iov_len){
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if(count > 0){
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return total;
+}
+
+// Write @param batch (@param count chunks) and set the end offset of each
+static void commit_batch(struct commit_req *batch, int count)
+{
+    static struct iovec iov[COMMIT_BATCH_MAX];
+    struct commit_req *req;
+    struct stat st;
+    size_t total = 0;
+    int i = 0;
+
+    for(req = batch; i < count; req = req->next, i++){
+        iov[i].iov_base = (void *)req->data;
+        iov[i].iov_len = req->len;
+        total += req->len;
+    }
+
+    // The timestamp thread still appends on its own, under the same lock
+    pthread_mutex_lock(&file_mutex);
+    bool ok = commit_writev(iov, count) != -1 && fstat(commit.data_fd, &st) != -1;
+    if(ok){
+        // In file order, before another batch can land
+        for(req = batch, i = 0; i < count; req = req->next, i++){
+            fanout_publish(req->data, req->len);
+        }
+    }
+    pthread_mutex_unlock(&file_mutex);
+
+    if(!ok){
+        AESD_LOG(LOG_ERR, "Failed to commit %d chunks: %m", count);
+    }
+
+    // Hand each writer the size the file had right after its own chunk
+    off_t end = ok ? st.st_size - (off_t)total : -1;
+    for(req = batch, i = 0; i < count; req = req->next, i++){
+        if(ok){
+            end += req->len;
+            req->end = end;
+        } else {
+            req->end = -1;
+        }
+    }
+    commit.dirty = commit.dirty || ok;
+    AESD_LOG(LOG_DEBUG, "Committed %d chunks, %zu bytes", count, total);
+}
+
+static void *committer_thread_func(void *arg)
+{
+    pthread_mutex_lock(&commit.lock);
+    while(true){
+        while(!commit.head && !commit.stopping){
+            if(commit.sync == COMMIT_SYNC_PERIODIC && commit.dirty){
+                // Only sleep with a deadline while there is something to sync
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += COMMIT_SYNC_INTERVAL_MS / 1000;
+                deadline.tv_nsec += (COMMIT_SYNC_INTERVAL_MS % 1000) * 1000000L;
+                if(deadline.tv_nsec >= 1000000000L){
+                    deadline.tv_sec++;
+                    deadline.tv_nsec -= 1000000000L;
+                }
+                if(pthread_cond_timedwait(&commit.pending, &commit.lock, &deadline) == ETIMEDOUT){
+                    pthread_mutex_unlock(&commit.lock);
+                    commit_sync_now();
+                    pthread_mutex_lock(&commit.lock);
+                }
+            } else {
+                pthread_cond_wait(&commit.pending, &commit.lock);
+            }
+        }
+        if(!commit.head){
+            break;
+        }
+
+        // Detach up to a full batch, later arrivals queue behind it
+        struct commit_req *batch = commit.head;
+        struct commit_req *last = batch;
+        int count = 1;
+        while(last->next && count < COMMIT_BATCH_MAX){
+            last = last->next;
+            count++;
+        }
+        commit.head = last->next;
+        if(!commit.head){
+            commit.tail = NULL;
+        }
+        pthread_mutex_unlock(&commit.lock);
+
+        commit_batch(batch, count);
+        if(commit.dirty && (commit.sync == COMMIT_SYNC_BATCH ||
+                            (commit.sync == COMMIT_SYNC_PERIODIC && commit_sync_due()))){
+            commit_sync_now();
+        }
+
+        pthread_mutex_lock(&commit.lock);
+        struct commit_req *req = batch;
+        for(int i = 0; i < count; i++){
+            struct commit_req *next = req->next;
+            req->done = true;
+            req = next;
+        }
+        pthread_cond_broadcast(&commit.committed);
+    }
+    pthread_mutex_unlock(&commit.lock);
+
+    if(commit.dirty && commit.sync != COMMIT_SYNC_NONE){
+        commit_sync_now();
+    }
+    pthread_exit(NULL);
+}
+
+int group_commit_start(enum commit_sync sync)
+{
+    commit.data_fd = open(OUTPUT_FILE, O_CREAT | O_APPEND | O_WRONLY | O_CLOEXEC, 0644);
+    if(commit.data_fd == -1){
+        AESD_LOG(LOG_ERR, "Failed to open data file for group commit: %m");
+        return -1;
+    }
+
+    commit.sync = sync;
+    commit.head = commit.tail = NULL;
+    commit.stopping = false;
+    commit.dirty = false;
+    clock_gettime(CLOCK_MONOTONIC, &commit.last_sync);
+
+    if(pthread_create(&commit.thread_id, NULL, committer_thread_func, NULL) != 0){
+        AESD_LOG(LOG_ERR, "Failed to create committer thread");
+        close(commit.data_fd);
+        commit.data_fd = -1;
+        return -1;
+    }
+    commit.active = true;
+    return 0;
+}
+
+bool group_commit_active(void)
+{
+    return commit.active;
+}
+
+off_t group_commit_append(const char *data, size_t len)
+{
+    struct commit_req req = {
+        .data = data,
+        .len = len,
+        .end = -1,
+        .done = false,
+        .next = NULL,
+    };
+
+    pthread_mutex_lock(&commit.lock);
+    if(commit.tail){
+        commit.tail->next = &req;
+    } else {
+        commit.head = &req;
+        // Only an empty queue can have a sleeping committer
+        pthread_cond_signal(&commit.pending);
+    }
+    commit.tail = &req;
+
+    while(!req.done){
+        pthread_cond_wait(&commit.committed, &commit.lock);
+    }
+    pthread_mutex_unlock(&commit.lock);
+
+    return req.end;
+}
+
+void group_commit_stop(void)
+{
+    if(!commit.active){
+        return;
+    }
+
+    pthread_mutex_lock(&commit.lock);
+    commit.stopping = true;
+    pthread_cond_signal(&commit.pending);
+    pthread_mutex_unlock(&commit.lock);
+
+    pthread_join(commit.thread_id, NULL);
+    commit.active = false;
+    close(commit.data_fd);
+    commit.data_fd = -1;
+}
+
+#endif
@@ -0,0 +1,56 @@
+/*
+ * group_commit.h
+ *
+ *  Group commit writer for the file backend.
+ *
+ *  Client threads hand their chunks to group_commit_append() and sleep; a
+ *  single committer thread gathers everything queued into one writev(2) on
+ *  the data file, then wakes the writers with the file offset where each of
+ *  their chunks ended.  With many clients that turns one write per chunk into
+ *  one write per batch, and one fdatasync per batch at most.
+ */
+
+#ifndef AESDSOCKET_GROUP_COMMIT_H
+#define AESDSOCKET_GROUP_COMMIT_H
+
+#include "stdbool.h"
+#include "stddef.h"
+#include "sys/types.h"
+
+// How often a periodic committer flushes dirty data to disk
+#define COMMIT_SYNC_INTERVAL_MS 1000
+
+// When committed data is forced to disk
+enum commit_sync {
+    COMMIT_SYNC_NONE,       // Left to the page cache
+    COMMIT_SYNC_PERIODIC,   // fdatasync at most every COMMIT_SYNC_INTERVAL_MS
+    COMMIT_SYNC_BATCH,      // fdatasync before any writer of a batch returns
+};
+
+/**
+ * Open OUTPUT_FILE for the committer and start its thread.
+ * @return 0 on success, -1 on failure (writers keep writing directly).
+ */
+int group_commit_start(enum commit_sync sync);
+
+/**
+ * @return true while the committer runs and appends must go through it.
+ */
+bool group_commit_active(void);
+
+/**
+ * Append the @param len bytes at @param data to the data file as part of
+ * the next batch, blocking until it is written (and synced if the mode asks
+ * for it), and push them to subscribers in the order the batch was written.
+ * Chunks from one thread are written in call order.
+ * @return the file size right after this chunk, -1 on a write error.
+ */
+off_t group_commit_append(const char *data, size_t len);
+
+/**
+ * Commit what is still queued, sync if needed and stop the committer.  No
+ * writer may be left calling group_commit_append().
+ */
+void group_commit_stop(void);
+
+#endif /* AESDSOCKET_GROUP_COMMIT_H */
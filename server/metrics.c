@@ -0,0 +1,219 @@
+#define _GNU_SOURCE
+#include "syslog.h"
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "stdint.h"
+#include "stdbool.h"
+#include "pthread.h"
+#include "time.h"
+#include "metrics.h"
+#include "aesdlog.h"
+
+// Histogram buckets are powers of two microseconds, 1 us to about 1 s, then +Inf
+#define HIST_BUCKETS 22
+
+struct metric_info {
+    const char *name;
+    const char *help;
+};
+
+static const struct metric_info counter_info[METRIC_COUNTERS] = {
+    [METRIC_CONN_ACCEPTED] = { "aesdsocket_connections_accepted_total", "Connections accepted" },
+    [METRIC_CONN_OPENED] = { "aesdsocket_connections_opened_total", "Connections set up for serving" },
+    [METRIC_CONN_CLOSED] = { "aesdsocket_connections_closed_total", "Connections closed" },
+    [METRIC_BYTES_IN] = { "aesdsocket_received_bytes_total", "Bytes received from clients" },
+    [METRIC_BYTES_OUT] = { "aesdsocket_sent_bytes_total", "Bytes sent to clients" },
+    [METRIC_PACKETS] = { "aesdsocket_packets_total", "Newline terminated packets stored" },
+    [METRIC_SEEKS] = { "aesdsocket_seeks_total", "AESDCHAR_IOCSEEKTO commands" },
+    [METRIC_SEND_ERRORS] = { "aesdsocket_send_errors_total", "Failed sends to clients" },
+    [METRIC_ADMIT_REJECTED] = { "aesdsocket_admission_rejected_total", "Connections turned away at the connection limit" },
+    [METRIC_ADMIT_PAUSED] = { "aesdsocket_admission_paused_total", "Times accepting paused at the connection limit" },
+    [METRIC_INFLIGHT_CLOSED] = { "aesdsocket_inflight_closed_total", "Connections closed over the in-flight byte limit" },
+    [METRIC_CACHE_HITS] = { "aesdsocket_readback_cache_hits_total", "Readbacks sent from the cached history" },
+    [METRIC_CACHE_REBUILDS] = { "aesdsocket_readback_cache_rebuilds_total", "Times the cached history was read from the device" },
+    [METRIC_SUB_PUSHED] = { "aesdsocket_subscriber_pushes_total", "Appends pushed to subscribers" },
+    [METRIC_SUB_DROPPED] = { "aesdsocket_subscriber_drops_total", "Pushes dropped for slow subscribers" },
+    [METRIC_SUB_DISCONNECTED] = { "aesdsocket_subscriber_disconnects_total", "Slow subscribers disconnected" },
+};
+
+static const struct metric_info histogram_info[METRIC_HISTOGRAMS] = {
+    [HIST_WRITE] = { "aesdsocket_write_latency_seconds", "Time to append a chunk to the device or file" },
+    [HIST_READBACK] = { "aesdsocket_readback_latency_seconds", "Time to send the history back to a client" },
+};
+
+struct metric_hist {
+    uint64_t buckets[HIST_BUCKETS];     // Not cumulative, summed when rendered
+    uint64_t sum_ns;
+};
+
+/**
+ * Written by its owning thread only, with relaxed stores so a concurrent
+ * reader never sees a torn value.  Cache line aligned, so neighbouring
+ * shards never share a line.  Shards are never freed.
+ */
+struct metrics_shard {
+    uint64_t counters[METRIC_COUNTERS];
+    struct metric_hist hists[METRIC_HISTOGRAMS];
+    bool in_use;            // Owned by a live thread, protected by shards_lock
+    struct metrics_shard *next;
+} __attribute__((aligned(64)));
+
+static struct metrics_shard *shards;
+static pthread_mutex_t shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t shard_key;
+static pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+
+static void shard_release(void *arg)
+{
+    struct metrics_shard *shard = (struct metrics_shard *)arg;
+
+    pthread_mutex_lock(&shards_lock);
+    shard->in_use = false;
+    pthread_mutex_unlock(&shards_lock);
+}
+
+static void shard_key_init(void)
+{
+    if(pthread_key_create(&shard_key, shard_release) != 0){
+        AESD_LOG(LOG_ERR, "Failed to create metrics shard key");
+    }
+}
+
+// Shard of the calling thread, taking over one left by an exited thread.
+// NULL when out of memory, the update is lost then.
+static struct metrics_shard *shard_get(void)
+{
+    struct metrics_shard *shard;
+
+    pthread_once(&shard_key_once, shard_key_init);
+    shard = pthread_getspecific(shard_key);
+    if(shard){
+        return shard;
+    }
+
+    pthread_mutex_lock(&shards_lock);
+    for(shard = shards; shard; shard = shard->next){
+        if(!shard->in_use){
+            break;
+        }
+    }
+    if(!shard){
+        // The size is a multiple of the alignment, as aligned_alloc() wants
+        shard = aligned_alloc(_Alignof(struct metrics_shard), sizeof(struct metrics_shard));
+        if(shard){
+            memset(shard, 0, sizeof(*shard));
+            shard->next = shards;
+            __atomic_store_n(&shards, shard, __ATOMIC_RELEASE);
+        }
+    }
+    if(shard){
+        shard->in_use = true;
+        pthread_setspecific(shard_key, shard);
+    }
+    pthread_mutex_unlock(&shards_lock);
+    return shard;
+}
+
+// Only the owner writes, a plain load and a relaxed store are enough
+static inline void shard_bump(uint64_t *slot, uint64_t value)
+{
+    __atomic_store_n(slot, __atomic_load_n(slot, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+void metrics_add(enum metric_counter counter, uint64_t value)
+{
+    struct metrics_shard *shard = shard_get();
+
+    if(shard){
+        shard_bump(&shard->counters[counter], value);
+    }
+}
+
+uint64_t metrics_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void metrics_observe(enum metric_histogram hist, uint64_t start)
+{
+    uint64_t elapsed = metrics_now() - start;
+    uint64_t us = elapsed / 1000;
+    struct metrics_shard *shard = shard_get();
+    if(!shard){
+        return;
+    }
+    struct metric_hist *h = &shard->hists[hist];
+
+    // Bucket i holds values up to 2^i us, the last one everything above
+    int bucket = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+    if(bucket >= HIST_BUCKETS){
+        bucket = HIST_BUCKETS - 1;
+    }
+    shard_bump(&h->buckets[bucket], 1);
+    shard_bump(&h->sum_ns, elapsed);
+}
+
+char *metrics_render(size_t *len)
+{
+    uint64_t counters[METRIC_COUNTERS] = { 0 };
+    struct metric_hist hists[METRIC_HISTOGRAMS] = { { { 0 } } };
+    char *text = NULL;
+
+    for(struct metrics_shard *shard = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); shard; shard = shard->next){
+        for(int i = 0; i < METRIC_COUNTERS; i++){
+            counters[i] += __atomic_load_n(&shard->counters[i], __ATOMIC_RELAXED);
+        }
+        for(int i = 0; i < METRIC_HISTOGRAMS; i++){
+            for(int b = 0; b < HIST_BUCKETS; b++){
+                hists[i].buckets[b] += __atomic_load_n(&shard->hists[i].buckets[b], __ATOMIC_RELAXED);
+            }
+            hists[i].sum_ns += __atomic_load_n(&shard->hists[i].sum_ns, __ATOMIC_RELAXED);
+        }
+    }
+
+    FILE *out = open_memstream(&text, len);
+    if(!out){
+        AESD_LOG(LOG_ERR, "Failed to render metrics: %m");
+        return NULL;
+    }
+
+    for(int i = 0; i < METRIC_COUNTERS; i++){
+        fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", counter_info[i].name,
+                counter_info[i].help, counter_info[i].name, counter_info[i].name,
+                (unsigned long long)counters[i]);
+    }
+
+    // Derived, opened and closed are read at slightly different times
+    uint64_t active = counters[METRIC_CONN_OPENED] - counters[METRIC_CONN_CLOSED];
+    fprintf(out, "# HELP aesdsocket_connections_active Connections being served\n"
+            "# TYPE aesdsocket_connections_active gauge\naesdsocket_connections_active %lld\n",
+            (long long)active);
+
+    for(int i = 0; i < METRIC_HISTOGRAMS; i++){
+        const char *name = histogram_info[i].name;
+        uint64_t cumulative = 0;
+
+        fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, histogram_info[i].help, name);
+        for(int b = 0; b < HIST_BUCKETS; b++){
+            cumulative += hists[i].buckets[b];
+            if(b == HIST_BUCKETS - 1){
+                fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)cumulative);
+            } else {
+                fprintf(out, "%s_bucket{le=\"%g\"} %llu\n", name, (double)(1ULL << b) / 1e6,
+                        (unsigned long long)cumulative);
+            }
+        }
+        fprintf(out, "%s_sum %.9f\n%s_count %llu\n", name, hists[i].sum_ns / 1e9,
+                name, (unsigned long long)cumulative);
+    }
+
+    if(fclose(out) != 0){
+        free(text);
+        return NULL;
+    }
+    return text;
+}
@@ -0,0 +1,79 @@
+/*
+ * metrics.h
+ *
+ *  Counters and latency histograms for aesdsocket.
+ *
+ *  Every thread that records a metric gets its own shard, a plain array it
+ *  alone writes to, so updating a counter on the client path is a load and a
+ *  store on a cache line no other thread writes.  Shards are only summed when
+ *  the metrics are read, by metrics_render(), which produces the Prometheus
+ *  text exposition format served on the metrics port and answered to the
+ *  AESDCHAR_STATS command.  A shard outlives its thread and is handed to the
+ *  next thread that needs one, so totals never go backwards.
+ */
+
+#ifndef AESDSOCKET_METRICS_H
+#define AESDSOCKET_METRICS_H
+
+#include "stddef.h"
+#include "stdint.h"
+
+// Command answered with the rendered metrics instead of being stored
+#define STATS_COMMAND "AESDCHAR_STATS"
+
+enum metric_counter {
+    METRIC_CONN_ACCEPTED,   // Sockets returned by accept()
+    METRIC_CONN_OPENED,     // Connections set up by conn_open()
+    METRIC_CONN_CLOSED,     // Connections torn down by conn_close()
+    METRIC_BYTES_IN,        // Bytes received from clients
+    METRIC_BYTES_OUT,       // Bytes sent to clients
+    METRIC_PACKETS,         // Newline terminated packets stored
+    METRIC_SEEKS,           // AESDCHAR_IOCSEEKTO commands
+    METRIC_SEND_ERRORS,     // Sends to a client that failed
+    METRIC_ADMIT_REJECTED,  // Connections turned away at the connection limit
+    METRIC_ADMIT_PAUSED,    // Times accepting paused at the connection limit
+    METRIC_INFLIGHT_CLOSED, // Connections closed over the in-flight byte limit
+    METRIC_CACHE_HITS,      // Readbacks sent from an up to date cached history
+    METRIC_CACHE_REBUILDS,  // Times the cached history was read from the device
+    METRIC_SUB_PUSHED,      // Appends pushed to a subscriber
+    METRIC_SUB_DROPPED,     // Pushes dropped for a slow subscriber
+    METRIC_SUB_DISCONNECTED,// Slow subscribers disconnected
+    METRIC_COUNTERS,
+};
+
+enum metric_histogram {
+    HIST_WRITE,             // Appending a chunk to the device or file
+    HIST_READBACK,          // Sending the history back to the client
+    METRIC_HISTOGRAMS,
+};
+
+/**
+ * Add @param value to counter @param counter of the calling thread's shard.
+ */
+void metrics_add(enum metric_counter counter, uint64_t value);
+
+static inline void metrics_inc(enum metric_counter counter)
+{
+    metrics_add(counter, 1);
+}
+
+/**
+ * @return a CLOCK_MONOTONIC timestamp in nanoseconds, to start a measurement
+ * for metrics_observe().
+ */
+uint64_t metrics_now(void);
+
+/**
+ * Record in histogram @param hist the time elapsed since @param start, a
+ * value returned by metrics_now().
+ */
+void metrics_observe(enum metric_histogram hist, uint64_t start);
+
+/**
+ * Sum every shard and render the result in the Prometheus text format.
+ * @return a malloc'ed string the caller frees, its length in @param len, or
+ * NULL if it could not be allocated.
+ */
+char *metrics_render(size_t *len);
+
+#endif /* AESDSOCKET_METRICS_H */
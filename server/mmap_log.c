@@ -0,0 +1,161 @@
+#define _GNU_SOURCE
+#include "sys/types.h"
+#include "sys/stat.h"
+#include "sys/mman.h"
+#include "syslog.h"
+#include "unistd.h"
+#include "fcntl.h"
+#include "string.h"
+#include "errno.h"
+#include "stdbool.h"
+#include "stdint.h"
+#include "pthread.h"
+#include "aesdsocket.h"
+#include "mmap_log.h"
+#include "fanout.h"
+#include "aesdlog.h"
+
+#ifndef USE_AESD_CHAR_DEVICE
+
+// Address space set aside for the log, it can never grow past this
+#define LOG_RESERVE_SIZE ((size_t)1 << (sizeof(void *) == 8 ? 36 : 28))
+
+static struct {
+    int fd;
+    char *base;         // Reserved range, segments are mapped from its start
+    size_t mapped;      // Bytes of file allocated and mapped
+    size_t length;      // Logical length, written under file_mutex
+    bool active;
+} mlog = {
+    .fd = -1,
+};
+
+// Allocate and map the file up to @param size, rounded to whole segments
+static int mmap_log_grow(size_t size)
+{
+    size_t target = (size + LOG_SEGMENT_SIZE - 1) / LOG_SEGMENT_SIZE * LOG_SEGMENT_SIZE;
+    if(target <= mlog.mapped){
+        return 0;
+    }
+    if(target > LOG_RESERVE_SIZE){
+        AESD_LOG(LOG_ERR, "Append log is full");
+        return -1;
+    }
+
+    int rc = fallocate(mlog.fd, 0, mlog.mapped, target - mlog.mapped);
+    if(rc == -1 && (errno == EOPNOTSUPP || errno == ENOSYS)){
+        // No preallocation on this filesystem, a sparse extension still works
+        rc = ftruncate(mlog.fd, target);
+    }
+    if(rc == -1){
+        AESD_LOG(LOG_ERR, "Failed to extend append log: %m");
+        return -1;
+    }
+
+    if(mmap(mlog.base + mlog.mapped, target - mlog.mapped, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_FIXED, mlog.fd, mlog.mapped) == MAP_FAILED){
+        AESD_LOG(LOG_ERR, "Failed to map append log segment: %m");
+        return -1;
+    }
+    mlog.mapped = target;
+    return 0;
+}
+
+int mmap_log_open(void)
+{
+    struct stat st;
+
+    mlog.fd = open(OUTPUT_FILE, O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+    if(mlog.fd == -1 || fstat(mlog.fd, &st) == -1){
+        AESD_LOG(LOG_ERR, "Failed to open append log: %m");
+        goto fail;
+    }
+
+    mlog.base = mmap(NULL, LOG_RESERVE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(mlog.base == MAP_FAILED){
+        mlog.base = NULL;
+        AESD_LOG(LOG_ERR, "Failed to reserve append log address space: %m");
+        goto fail;
+    }
+
+    mlog.mapped = 0;
+    if(mmap_log_grow(st.st_size) == -1){
+        goto fail;
+    }
+
+    // A log that was not closed cleanly still carries its preallocated tail
+    mlog.length = st.st_size;
+    while(mlog.length > 0 && mlog.base[mlog.length - 1] == '\0'){
+        mlog.length--;
+    }
+
+    mlog.active = true;
+    AESD_LOG(LOG_INFO, "Append log mapped, %zu bytes of history", mlog.length);
+    return 0;
+
+fail:
+    if(mlog.base){
+        munmap(mlog.base, LOG_RESERVE_SIZE);
+        mlog.base = NULL;
+    }
+    if(mlog.fd != -1){
+        close(mlog.fd);
+        mlog.fd = -1;
+    }
+    return -1;
+}
+
+bool mmap_log_active(void)
+{
+    return mlog.active;
+}
+
+off_t mmap_log_append(const char *data, size_t len)
+{
+    off_t end = -1;
+
+    pthread_mutex_lock(&file_mutex);
+    if(mmap_log_grow(mlog.length + len) == 0){
+        memcpy(mlog.base + mlog.length, data, len);
+        end = mlog.length + len;
+        // Readers load the length without the lock, publish the bytes first
+        __atomic_store_n(&mlog.length, (size_t)end, __ATOMIC_RELEASE);
+        fanout_publish(data, len);
+    }
+    pthread_mutex_unlock(&file_mutex);
+    return end;
+}
+
+size_t mmap_log_length(void)
+{
+    return __atomic_load_n(&mlog.length, __ATOMIC_ACQUIRE);
+}
+
+const char *mmap_log_data(void)
+{
+    return mlog.base;
+}
+
+int mmap_log_fd(void)
+{
+    return mlog.fd;
+}
+
+void mmap_log_close(void)
+{
+    if(!mlog.active){
+        return;
+    }
+
+    mlog.active = false;
+    if(ftruncate(mlog.fd, mlog.length) == -1){
+        AESD_LOG(LOG_ERR, "Failed to trim append log: %m");
+    }
+    munmap(mlog.base, LOG_RESERVE_SIZE);
+    mlog.base = NULL;
+    mlog.mapped = 0;
+    close(mlog.fd);
+    mlog.fd = -1;
+}
+
+#endif
@@ -0,0 +1,65 @@
+/*
+ * mmap_log.h
+ *
+ *  Memory mapped append log for the file backend.
+ *
+ *  OUTPUT_FILE is opened once and mapped into a reserved address range that
+ *  never moves.  The file grows in LOG_SEGMENT_SIZE steps with fallocate and
+ *  each new segment is mapped right after the previous one, so a pointer into
+ *  the log stays valid for the life of the process.  Appends are a memcpy
+ *  under file_mutex followed by a release store of the length, no write
+ *  syscall.  Readback sendfile()s the log descriptor, which shares the page
+ *  cache with the mapping, and sends straight from the mapping whatever a
+ *  socket refuses, so no read syscall or bounce buffer is left.  The file is
+ *  trimmed to the logical length when the log closes.
+ */
+
+#ifndef AESDSOCKET_MMAP_LOG_H
+#define AESDSOCKET_MMAP_LOG_H
+
+#include "stdbool.h"
+#include "stddef.h"
+#include "sys/types.h"
+
+// Preallocation step, a multiple of the page size
+#define LOG_SEGMENT_SIZE (1024 * 1024)
+
+/**
+ * Open and map OUTPUT_FILE, keeping what it already holds.
+ * @return 0 on success, -1 on failure.
+ */
+int mmap_log_open(void);
+
+/**
+ * @return true while the log is open and appends must go through it.
+ */
+bool mmap_log_active(void);
+
+/**
+ * Append @param len bytes at @param data and push them to subscribers.
+ * Takes file_mutex.
+ * @return the log length right after this append, -1 on failure.
+ */
+off_t mmap_log_append(const char *data, size_t len);
+
+/**
+ * @return the log length, every byte below it is fully written.
+ */
+size_t mmap_log_length(void);
+
+/**
+ * @return the start of the mapped log, valid until mmap_log_close().
+ */
+const char *mmap_log_data(void);
+
+/**
+ * @return the log descriptor, for sendfile(2).
+ */
+int mmap_log_fd(void);
+
+/**
+ * Trim the file to the logical length, unmap and close it.
+ */
+void mmap_log_close(void);
+
+#endif /* AESDSOCKET_MMAP_LOG_H */
@@ -0,0 +1,211 @@
+/*
+ * readback-bench.c
+ *
+ *  Compares the file mode readback strategies of aesdsocket: the read()+send()
+ *  copy through a BUFFER_SIZE bounce buffer, sendfile(2), and a single send()
+ *  straight from a shared mapping of the file as the mmap log does.
+ *  For each history size a data file is streamed to a loopback TCP socket
+ *  while a second thread drains it, and the sender's CPU time per MB is
+ *  reported.
+ *
+ *  Usage: readback-bench [-s max_mb] [-r rounds] [-f path]
+ */
+
+#define _DEFAULT_SOURCE
+#include "sys/socket.h"
+#include "sys/types.h"
+#include "sys/stat.h"
+#include "sys/sendfile.h"
+#include "sys/mman.h"
+#include "netinet/in.h"
+#include "arpa/inet.h"
+#include "unistd.h"
+#include "fcntl.h"
+#include "string.h"
+#include "stdlib.h"
+#include "stdio.h"
+#include "errno.h"
+#include "pthread.h"
+#include "time.h"
+
+#define BUFFER_SIZE 1024
+#define DEFAULT_MAX_MB 64
+#define DEFAULT_ROUNDS 5
+#define DEFAULT_PATH "/var/tmp/readback-bench.dat"
+
+static double ts_diff(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void *drain_thread_func(void *arg)
+{
+    int fd = *(int *)arg;
+    static char sink[1 << 16];
+
+    while(recv(fd, sink, sizeof(sink), 0) > 0){
+    }
+    return NULL;
+}
+
+// Connected loopback pair, the receiving end is drained by a thread
+static int open_sink(pthread_t *drain_tid, int *rx_fd)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int tx_fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(listen_fd == -1 || tx_fd == -1 ||
+       bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+       listen(listen_fd, 1) == -1 ||
+       getsockname(listen_fd, (struct sockaddr *)&addr, &addr_len) == -1 ||
+       connect(tx_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1){
+        perror("loopback setup");
+        exit(EXIT_FAILURE);
+    }
+    *rx_fd = accept(listen_fd, NULL, NULL);
+    close(listen_fd);
+    if(*rx_fd == -1 || pthread_create(drain_tid, NULL, drain_thread_func, rx_fd) != 0){
+        perror("drain setup");
+        exit(EXIT_FAILURE);
+    }
+    return tx_fd;
+}
+
+static void readback_copy(int data_fd, int sock_fd)
+{
+    char file_buffer[BUFFER_SIZE];
+    ssize_t bytes_read;
+
+    lseek(data_fd, 0, SEEK_SET);
+    while((bytes_read = read(data_fd, file_buffer, BUFFER_SIZE)) > 0){
+        if(send(sock_fd, file_buffer, bytes_read, MSG_NOSIGNAL) == -1){
+            perror("send");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static void readback_sendfile(int data_fd, int sock_fd)
+{
+    struct stat st;
+    off_t offset = 0;
+
+    fstat(data_fd, &st);
+    while(offset < st.st_size){
+        if(sendfile(sock_fd, data_fd, &offset, st.st_size - offset) == -1 && errno != EINTR){
+            perror("sendfile");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+static void readback_mmap(int data_fd, int sock_fd)
+{
+    struct stat st;
+
+    // aesdsocket maps once; mapping per round only adds page table setup
+    fstat(data_fd, &st);
+    char *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, data_fd, 0);
+    if(base == MAP_FAILED){
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+    for(off_t offset = 0; offset < st.st_size; ){
+        ssize_t sent = send(sock_fd, base + offset, st.st_size - offset, MSG_NOSIGNAL);
+        if(sent == -1){
+            perror("send");
+            exit(EXIT_FAILURE);
+        }
+        offset += sent;
+    }
+    munmap(base, st.st_size);
+}
+
+static void run(const char *name, void (*readback)(int, int), int data_fd, size_t size, int rounds)
+{
+    struct timespec cpu_start, cpu_end, wall_start, wall_end;
+    pthread_t drain_tid;
+    int rx_fd;
+    int tx_fd = open_sink(&drain_tid, &rx_fd);
+    double mb = (double)size * rounds / (1024 * 1024);
+
+    clock_gettime(CLOCK_MONOTONIC, &wall_start);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+    for(int i = 0; i < rounds; i++){
+        readback(data_fd, tx_fd);
+    }
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+    clock_gettime(CLOCK_MONOTONIC, &wall_end);
+
+    shutdown(tx_fd, SHUT_WR);
+    pthread_join(drain_tid, NULL);
+    close(tx_fd);
+    close(rx_fd);
+
+    printf("%-10zu %-9s %12.3f %10.1f\n", size / 1024, name,
+           ts_diff(&cpu_start, &cpu_end) * 1000 / mb, mb / ts_diff(&wall_start, &wall_end));
+}
+
+int main(int argc, char *argv[])
+{
+    long max_mb = DEFAULT_MAX_MB;
+    int rounds = DEFAULT_ROUNDS;
+    const char *path = DEFAULT_PATH;
+    char line[BUFFER_SIZE];
+    int opt;
+
+    while((opt = getopt(argc, argv, "s:r:f:")) != -1){
+        switch(opt){
+            case 's':
+                max_mb = strtol(optarg, NULL, 10);
+                break;
+            case 'r':
+                rounds = atoi(optarg);
+                break;
+            case 'f':
+                path = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-s max_mb] [-r rounds] [-f path]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if(max_mb < 1 || rounds < 1){
+        fprintf(stderr, "Size and rounds must be positive\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int data_fd = open(path, O_CREAT | O_TRUNC | O_APPEND | O_RDWR, 0644);
+    if(data_fd == -1){
+        perror("open");
+        exit(EXIT_FAILURE);
+    }
+
+    // History of newline terminated packets, as aesdsocket would have written it
+    memset(line, 'x', sizeof(line) - 1);
+    line[sizeof(line) - 1] = '\n';
+
+    printf("%-10s %-9s %12s %10s\n", "history_kb", "method", "cpu_ms_per_mb", "mb_per_s");
+    size_t size = 0;
+    for(size_t target = 256 * 1024; target <= (size_t)max_mb * 1024 * 1024; target *= 4){
+        while(size < target){
+            if(write(data_fd, line, sizeof(line)) != sizeof(line)){
+                perror("write");
+                exit(EXIT_FAILURE);
+            }
+            size += sizeof(line);
+        }
+        run("copy", readback_copy, data_fd, size, rounds);
+        run("sendfile", readback_sendfile, data_fd, size, rounds);
+        run("mmap", readback_mmap, data_fd, size, rounds);
+    }
+
+    close(data_fd);
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,171 @@
+#define _GNU_SOURCE
+#include "sys/types.h"
+#include "sys/ioctl.h"
+#include "syslog.h"
+#include "unistd.h"
+#include "fcntl.h"
+#include "stdlib.h"
+#include "stdint.h"
+#include "stdbool.h"
+#include "errno.h"
+#include "pthread.h"
+#include "aesd_ioctl.h"
+#include "aesdsocket.h"
+#include "readback_cache.h"
+#include "metrics.h"
+#include "aesdlog.h"
+
+#ifdef USE_AESD_CHAR_DEVICE
+
+// Reads of the device an eviction may restart before the snapshot fails
+#define SNAPSHOT_ATTEMPTS 4
+
+static struct {
+    int fd;                             // Own descriptor, clients' positions stay put
+    struct readback_snapshot *current;  // Protected by lock
+    uint64_t generation;                // Atomic, bumped by every write
+    pthread_mutex_t lock;               // Also held while rebuilding
+} cache = {
+    .fd = -1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+uint64_t readback_device_base(int fd)
+{
+    uint64_t base;
+
+    if(ioctl(fd, AESDCHAR_IOCGBASE, &base) == -1){
+        // A driver or a plain file without the ioctl never evicts as seen here
+        if(errno != ENOTTY){
+            AESD_LOG(LOG_ERR, "Failed to read the char device base: %m");
+        }
+        return 0;
+    }
+    return base;
+}
+
+void readback_cache_invalidate(void)
+{
+    __atomic_add_fetch(&cache.generation, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Read the whole device into a new snapshot stamped with @param generation,
+ * taken before reading so a write racing with the read makes it stale.
+ * @return the snapshot holding one reference, NULL on failure.
+ */
+static struct readback_snapshot *snapshot_read(uint64_t generation)
+{
+    struct readback_snapshot *snap = NULL;
+    size_t cap;
+    size_t len = 0;
+
+    if(cache.fd == -1){
+        cache.fd = open(OUTPUT_FILE, O_RDONLY);
+        if(cache.fd == -1){
+            AESD_LOG(LOG_ERR, "Failed to open char device for the readback cache: %m");
+            return NULL;
+        }
+    }
+
+    // Sized to the history, with room to notice it grew since
+    off_t end = lseek(cache.fd, 0, SEEK_END);
+    cap = (end > 0 ? end : 0) + BUFFER_SIZE;
+    for(int attempt = 0; attempt < SNAPSHOT_ATTEMPTS; attempt++){
+        uint64_t base = readback_device_base(cache.fd);
+
+        len = 0;
+        lseek(cache.fd, 0, SEEK_SET);
+        while(true){
+            struct readback_snapshot *new_snap = realloc(snap, sizeof(*snap) + cap);
+            if(!new_snap){
+                AESD_LOG(LOG_ERR, "Failed to allocate a %zu byte readback snapshot", cap);
+                free(snap);
+                return NULL;
+            }
+            snap = new_snap;
+
+            ssize_t bytes_read = 0;
+            while(len < cap && (bytes_read = read(cache.fd, snap->data + len, cap - len)) > 0){
+                len += bytes_read;
+            }
+            if(bytes_read == -1){
+                AESD_LOG(LOG_ERR, "Failed to read char device for the readback cache: %m");
+                free(snap);
+                return NULL;
+            }
+            if(len < cap){
+                break;
+            }
+            cap *= 2;
+        }
+
+        // An eviction while reading shifted the bytes under the reads
+        if(readback_device_base(cache.fd) == base){
+            snap->base = base;
+            break;
+        }
+        if(attempt + 1 == SNAPSHOT_ATTEMPTS){
+            AESD_LOG(LOG_ERR, "Char device kept evicting while building the readback cache");
+            free(snap);
+            return NULL;
+        }
+    }
+
+    snap->refs = 1;
+    snap->generation = generation;
+    snap->len = len;
+    return snap;
+}
+
+struct readback_snapshot *readback_cache_get(void)
+{
+    uint64_t generation = __atomic_load_n(&cache.generation, __ATOMIC_ACQUIRE);
+    struct readback_snapshot *snap;
+
+    pthread_mutex_lock(&cache.lock);
+    // A reader that loaded the generation before another one rebuilt is
+    // served by that newer snapshot too
+    if(cache.current && cache.current->generation >= generation){
+        metrics_inc(METRIC_CACHE_HITS);
+    } else {
+        // Readers arriving meanwhile wait here and share the result
+        snap = snapshot_read(generation);
+        if(!snap){
+            pthread_mutex_unlock(&cache.lock);
+            return NULL;
+        }
+        if(cache.current){
+            readback_cache_put(cache.current);
+        }
+        cache.current = snap;
+        metrics_inc(METRIC_CACHE_REBUILDS);
+    }
+    snap = cache.current;
+    __atomic_add_fetch(&snap->refs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&cache.lock);
+    return snap;
+}
+
+void readback_cache_put(struct readback_snapshot *snap)
+{
+    if(__atomic_sub_fetch(&snap->refs, 1, __ATOMIC_ACQ_REL) == 0){
+        free(snap);
+    }
+}
+
+void readback_cache_close(void)
+{
+    pthread_mutex_lock(&cache.lock);
+    if(cache.current){
+        readback_cache_put(cache.current);
+        cache.current = NULL;
+    }
+    if(cache.fd != -1){
+        close(cache.fd);
+        cache.fd = -1;
+    }
+    pthread_mutex_unlock(&cache.lock);
+}
+
+#endif
@@ -0,0 +1,67 @@
+/*
+ * readback_cache.h
+ *
+ *  Shared copy of the char device history for readbacks.
+ *
+ *  Reading the history back means taking the driver mutex and copying every
+ *  entry out of the kernel, and clients finishing a packet together would
+ *  each do it for the same bytes.  The cache instead keeps the whole history
+ *  in one refcounted snapshot stamped with a write generation.  Every write
+ *  to the device bumps the generation; the first reader to see a stamp older
+ *  than the generation reads the device once into a new snapshot, and every
+ *  other reader sends from that snapshot.  A snapshot stays valid while a
+ *  reference is held, even after a newer one replaced it.
+ *
+ *  Only writes made through aesdsocket bump the generation, a process
+ *  writing to the device directly is not seen until the next one.
+ *
+ *  Once the device is full every entry added evicts the oldest one, so a
+ *  position in what the device returns says nothing on its own.  Snapshots
+ *  carry the stream offset of their first byte, counting every byte ever
+ *  stored, to compare positions across snapshots.
+ */
+
+#ifndef AESDSOCKET_READBACK_CACHE_H
+#define AESDSOCKET_READBACK_CACHE_H
+
+#include "stddef.h"
+#include "stdint.h"
+
+struct readback_snapshot {
+    unsigned long refs;         // Atomic, one held by the cache while current
+    uint64_t generation;        // Write generation the history was read at
+    uint64_t base;              // Stream offset of data[0], bytes evicted before it
+    size_t len;
+    char data[];
+};
+
+/**
+ * @return the stream offset of the oldest byte the device open as
+ * @param fd still holds, 0 if the driver cannot tell (no AESDCHAR_IOCGBASE).
+ */
+uint64_t readback_device_base(int fd);
+
+/**
+ * Mark the cached history stale, after a write to the device.
+ */
+void readback_cache_invalidate(void);
+
+/**
+ * @return a reference to a snapshot holding the history as of at least the
+ * last readback_cache_invalidate(), reading the device if needed, or NULL on
+ * failure.  Release it with readback_cache_put().
+ */
+struct readback_snapshot *readback_cache_get(void);
+
+/**
+ * Drop a reference returned by readback_cache_get().
+ */
+void readback_cache_put(struct readback_snapshot *snap);
+
+/**
+ * Release the current snapshot and the cache descriptor, once no client is
+ * left.
+ */
+void readback_cache_close(void);
+
+#endif /* AESDSOCKET_READBACK_CACHE_H */
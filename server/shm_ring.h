@@ -0,0 +1,91 @@
+/*
+ * shm_ring.h
+ *
+ *  Shared memory ring transport of aesdsocket, for producers on the same
+ *  host.
+ *
+ *  A client connected over the Unix socket listener sends the line
+ *  SHM_NEGOTIATE.  The server answers SHM_NEGOTIATE_ACK with three
+ *  descriptors attached (SCM_RIGHTS): a memfd holding a struct shm_ring, the
+ *  submit eventfd and the completion eventfd.  A server that cannot offer
+ *  the ring on this connection answers SHM_NEGOTIATE_NAK and the connection
+ *  carries on as before.
+ *
+ *  The client then pushes records into the ring with shm_ring_push() and
+ *  writes 1 to the submit eventfd.  The server appends every record to the
+ *  history as is, without a readback, moves tail past it and writes 1 to the
+ *  completion eventfd; a record is stored once tail passed it.  Records are
+ *  data only, commands and their replies keep going over the socket, which
+ *  also ends the session when it closes.
+ *
+ *  Records start 8 byte aligned with a struct shm_record header.  One that
+ *  does not fit before the end of the ring is preceded by a SHM_WRAP header
+ *  filling the rest, and starts over at offset 0.
+ */
+
+#ifndef AESDSOCKET_SHM_RING_H
+#define AESDSOCKET_SHM_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define SHM_NEGOTIATE "AESDCHAR_SHM"
+#define SHM_NEGOTIATE_ACK "AESDCHAR_SHM OK\n"
+#define SHM_NEGOTIATE_NAK "AESDCHAR_SHM UNAVAILABLE\n"
+
+// Data bytes of the ring, a power of two
+#define SHM_RING_SIZE (1024 * 1024)
+// Longest record, so that one always fits once the ring drains
+#define SHM_RECORD_MAX (SHM_RING_SIZE / 2)
+// Length of the header skipping to the start of the ring
+#define SHM_WRAP UINT32_MAX
+
+struct shm_record {
+    uint32_t len;           // Data bytes that follow, or SHM_WRAP
+    uint32_t reserved;
+};
+
+struct shm_ring {
+    // Bytes ever pushed, written by the client only
+    uint64_t head __attribute__((aligned(64)));
+    // Bytes ever consumed, written by the server only
+    uint64_t tail __attribute__((aligned(64)));
+    char data[SHM_RING_SIZE] __attribute__((aligned(64)));
+};
+
+static inline size_t shm_record_size(uint32_t len)
+{
+    return sizeof(struct shm_record) + (((size_t)len + 7) & ~(size_t)7);
+}
+
+/**
+ * Copy a record of the @param len bytes at @param data into @param ring,
+ * client side.  The server only sees it once the submit eventfd is written.
+ * @return 0, or -1 if it does not fit until the server consumes more.
+ */
+static inline int shm_ring_push(struct shm_ring *ring, const void *data, uint32_t len)
+{
+    uint64_t head = ring->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    size_t pos = head & (SHM_RING_SIZE - 1);
+    size_t need = shm_record_size(len);
+    size_t skip = pos + need > SHM_RING_SIZE ? SHM_RING_SIZE - pos : 0;
+    struct shm_record rec = { .len = len };
+
+    if(len > SHM_RECORD_MAX || head + skip + need - tail > SHM_RING_SIZE){
+        return -1;
+    }
+    if(skip){
+        struct shm_record wrap = { .len = SHM_WRAP };
+        memcpy(ring->data + pos, &wrap, sizeof(wrap));
+        head += skip;
+        pos = 0;
+    }
+    memcpy(ring->data + pos, &rec, sizeof(rec));
+    memcpy(ring->data + pos + sizeof(rec), data, len);
+    __atomic_store_n(&ring->head, head + need, __ATOMIC_RELEASE);
+    return 0;
+}
+
+#endif /* AESDSOCKET_SHM_RING_H */
@@ -0,0 +1,225 @@
+#define _GNU_SOURCE
+#include "sys/socket.h"
+#include "sys/types.h"
+#include "sys/mman.h"
+#include "sys/eventfd.h"
+#include "sys/un.h"
+#include "syslog.h"
+#include "unistd.h"
+#include "string.h"
+#include "stdlib.h"
+#include "stdint.h"
+#include "stdbool.h"
+#include "errno.h"
+#include "poll.h"
+#include "connection.h"
+#include "shm_ring.h"
+#include "shm_transport.h"
+#include "metrics.h"
+#include "aesdlog.h"
+
+struct shm_session {
+    struct shm_ring *ring;
+    int submit_fd;          // Written by the client after pushing
+    int complete_fd;        // Written by the server after consuming
+    uint64_t tail;          // Private copy, the client may scribble on the ring
+    char *record;           // Private copy of the record being appended
+    size_t record_cap;
+};
+
+// Send the acknowledgement line with @param fds attached
+static int shm_send_ack(int client_fd, const int fds[3])
+{
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = { .iov_base = SHM_NEGOTIATE_ACK, .iov_len = strlen(SHM_NEGOTIATE_ACK) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+
+    memset(control, 0, sizeof(control));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(3 * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, 3 * sizeof(int));
+
+    // A blocking Unix socket takes a line this short whole
+    ssize_t sent = sendmsg(client_fd, &msg, MSG_NOSIGNAL);
+    if(sent != (ssize_t)iov.iov_len){
+        return -1;
+    }
+    metrics_add(METRIC_BYTES_OUT, sent);
+    return 0;
+}
+
+struct shm_session *shm_session_open(int client_fd)
+{
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof(addr);
+
+    // Descriptors can only be passed over a Unix socket
+    if(getsockname(client_fd, (struct sockaddr *)&addr, &addr_len) == -1 || addr.ss_family != AF_UNIX){
+        return NULL;
+    }
+
+    struct shm_session *session = calloc(1, sizeof(*session));
+    if(!session){
+        AESD_LOG(LOG_ERR, "Failed to allocate shm session");
+        return NULL;
+    }
+    session->ring = MAP_FAILED;
+    session->submit_fd = eventfd(0, EFD_CLOEXEC);
+    session->complete_fd = eventfd(0, EFD_CLOEXEC);
+    int mem_fd = memfd_create("aesdsocket-shm", MFD_CLOEXEC);
+    if(session->submit_fd == -1 || session->complete_fd == -1 || mem_fd == -1 ||
+       ftruncate(mem_fd, sizeof(struct shm_ring)) == -1){
+        AESD_LOG(LOG_ERR, "Failed to create shm ring: %m");
+        goto fail;
+    }
+    session->ring = mmap(NULL, sizeof(struct shm_ring), PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, 0);
+    if(session->ring == MAP_FAILED){
+        AESD_LOG(LOG_ERR, "Failed to map shm ring: %m");
+        goto fail;
+    }
+
+    int fds[3] = { mem_fd, session->submit_fd, session->complete_fd };
+    if(shm_send_ack(client_fd, fds) == -1){
+        AESD_LOG(LOG_ERR, "Failed to hand shm ring to fd %d: %m", client_fd);
+        goto fail;
+    }
+    close(mem_fd);
+    AESD_LOG(LOG_DEBUG, "Serving fd %d through a shm ring", client_fd);
+    return session;
+
+fail:
+    if(mem_fd != -1){
+        close(mem_fd);
+    }
+    shm_session_close(session);
+    return NULL;
+}
+
+/**
+ * Append every record submitted so far and signal completion.
+ * @return 0 on success, -1 if the ring is corrupt or an append failed.
+ */
+static int shm_session_drain(struct shm_session *session, struct aesd_conn *conn)
+{
+    struct shm_ring *ring = session->ring;
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = session->tail;
+    uint64_t one = 1;
+
+    if(head - tail > SHM_RING_SIZE){
+        AESD_LOG(LOG_ERR, "shm ring head %llu out of range", (unsigned long long)head);
+        return -1;
+    }
+    while(tail != head){
+        size_t pos = tail & (SHM_RING_SIZE - 1);
+        struct shm_record rec;
+
+        memcpy(&rec, ring->data + pos, sizeof(rec));
+        if(rec.len == SHM_WRAP){
+            // A skip past head would let tail overtake it and never stop
+            if(SHM_RING_SIZE - pos > head - tail){
+                AESD_LOG(LOG_ERR, "Malformed shm wrap at offset %zu", pos);
+                return -1;
+            }
+            tail += SHM_RING_SIZE - pos;
+            continue;
+        }
+        size_t size = shm_record_size(rec.len);
+        if(rec.len > SHM_RECORD_MAX || pos + size > SHM_RING_SIZE || size > head - tail){
+            AESD_LOG(LOG_ERR, "Malformed shm record of %u bytes", rec.len);
+            return -1;
+        }
+
+        // Copied once, the client could change the bytes between the write
+        // and the push to subscribers otherwise
+        if(rec.len > session->record_cap){
+            char *record = realloc(session->record, rec.len);
+            if(!record){
+                AESD_LOG(LOG_ERR, "Failed to allocate a %u byte shm record", rec.len);
+                return -1;
+            }
+            session->record = record;
+            session->record_cap = rec.len;
+        }
+        memcpy(session->record, ring->data + pos + sizeof(rec), rec.len);
+
+        const char *data = session->record;
+        metrics_add(METRIC_BYTES_IN, rec.len);
+        if(conn_append(conn, data, rec.len, false) == -1){
+            return -1;
+        }
+        if(rec.len > 0 && data[rec.len - 1] == '\n'){
+            metrics_inc(METRIC_PACKETS);
+        }
+        tail += size;
+    }
+
+    session->tail = tail;
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    if(write(session->complete_fd, &one, sizeof(one)) == -1){
+        AESD_LOG(LOG_ERR, "Failed to signal shm completion: %m");
+    }
+    return 0;
+}
+
+ssize_t shm_session_serve(struct shm_session *session, struct aesd_conn *conn,
+                          char *buffer, size_t cap)
+{
+    struct pollfd pfds[2] = {
+        { .fd = conn->client_fd, .events = POLLIN },
+        { .fd = session->submit_fd, .events = POLLIN },
+    };
+    uint64_t count;
+
+    while(true){
+        if(poll(pfds, 2, -1) == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            AESD_LOG(LOG_ERR, "shm poll failed: %m");
+            return -1;
+        }
+        if(pfds[1].revents & POLLIN){
+            // Polled readable first, so this never blocks
+            if(read(session->submit_fd, &count, sizeof(count)) == -1 ||
+               shm_session_drain(session, conn) == -1){
+                return -1;
+            }
+        }
+        if(pfds[0].revents){
+            ssize_t bytes_received = conn_recv(conn, buffer, cap);
+            if(bytes_received <= 0){
+                // Records pushed right before closing still count
+                if(shm_session_drain(session, conn) == -1){
+                    return -1;
+                }
+                return bytes_received;
+            }
+            if(conn_handle_data(conn, buffer, bytes_received) == -1){
+                return -1;
+            }
+        }
+    }
+}
+
+void shm_session_close(struct shm_session *session)
+{
+    if(session->ring != MAP_FAILED){
+        munmap(session->ring, sizeof(struct shm_ring));
+    }
+    if(session->submit_fd != -1){
+        close(session->submit_fd);
+    }
+    if(session->complete_fd != -1){
+        close(session->complete_fd);
+    }
+    free(session->record);
+    free(session);
+}
@@ -0,0 +1,44 @@
+/*
+ * shm_transport.h
+ *
+ *  Server side of the shared memory ring of shm_ring.h.
+ *
+ *  The ring is offered to blocking connections on the Unix socket listener
+ *  served by the sync data path; the thread serving the connection then
+ *  waits on the socket and the submit eventfd together, appending records
+ *  as they are submitted and handling whatever arrives on the socket as
+ *  usual.
+ */
+
+#ifndef AESDSOCKET_SHM_TRANSPORT_H
+#define AESDSOCKET_SHM_TRANSPORT_H
+
+#include "stddef.h"
+#include "sys/types.h"
+
+struct aesd_conn;
+struct shm_session;
+
+/**
+ * Create a ring for the client on @param client_fd and send it
+ * SHM_NEGOTIATE_ACK with the descriptors.
+ * @return the session, NULL if the socket is not a Unix one or setting up
+ * failed, nothing was sent then.
+ */
+struct shm_session *shm_session_open(int client_fd);
+
+/**
+ * Serve @param conn from the ring of @param session and its socket until
+ * the client goes away, @param buffer of @param cap bytes takes socket
+ * input.
+ * @return 0 once the client closed, -1 on failure.
+ */
+ssize_t shm_session_serve(struct shm_session *session, struct aesd_conn *conn,
+                          char *buffer, size_t cap);
+
+/**
+ * Unmap the ring and close the eventfds of @param session.
+ */
+void shm_session_close(struct shm_session *session);
+
+#endif /* AESDSOCKET_SHM_TRANSPORT_H */
@@ -0,0 +1,422 @@
+/*
+ * transport-bench.c
+ *
+ *  Per-packet latency of the local transports of aesdsocket: loopback TCP,
+ *  the Unix socket listener and the shared memory ring of shm_ring.h.  One
+ *  client sends packets one at a time and times each until the server has
+ *  stored it.
+ *
+ *  Over the sockets the connection switches to delta readbacks first, so the
+ *  acknowledgement of a packet is the packet itself rather than the whole
+ *  history, and a packet counts as stored once its echo is back.  Through the
+ *  ring a packet counts as stored once the server moved tail past it, which
+ *  it announces on the completion eventfd.  Writes from other clients during
+ *  a run show up in the socket echoes and only add to those latencies.
+ *
+ *  Usage: transport-bench [-t tcp|unix|shm|all] [-H host] [-P port]
+ *         [-U unix_socket_path] [-n packets] [-w warmup] [-s size]
+ */
+
+#define _GNU_SOURCE
+#include "sys/socket.h"
+#include "sys/types.h"
+#include "sys/un.h"
+#include "sys/mman.h"
+#include "netinet/in.h"
+#include "netinet/tcp.h"
+#include "netdb.h"
+#include "unistd.h"
+#include "string.h"
+#include "stdlib.h"
+#include "stdio.h"
+#include "stdint.h"
+#include "stdbool.h"
+#include "errno.h"
+#include "time.h"
+#include "shm_ring.h"
+
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT "9000"
+#define DEFAULT_UNIX_PATH "/var/tmp/aesdsocket.sock"
+#define DEFAULT_PACKETS 10000
+#define DEFAULT_WARMUP 100
+#define DEFAULT_SIZE 64
+// Skips whatever history there is, then only new packets come back
+#define DELTA_SETUP "AESDCHAR_TAIL:18446744073709551615\nAESDCHAR_DELTA:1\n"
+
+enum transport {
+    TRANSPORT_TCP,
+    TRANSPORT_UNIX,
+    TRANSPORT_SHM,
+    TRANSPORTS,
+};
+
+static const char *transport_names[TRANSPORTS] = { "tcp", "unix", "shm" };
+
+struct bench_config {
+    const char *host;
+    const char *port;
+    const char *unix_path;
+    long packets;
+    long warmup;
+    size_t size;
+};
+
+// One connected client, sockets use fd only
+struct client {
+    int fd;
+    struct shm_ring *ring;
+    int submit_fd;
+    int complete_fd;
+    char *rx_buf;
+    size_t rx_cap;
+};
+
+static double now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest rank percentile of @param count sorted samples
+static double percentile(const double *values, long count, double p)
+{
+    long rank = (long)(p / 100.0 * count + 0.5);
+    if(rank < 1){
+        rank = 1;
+    }
+    if(rank > count){
+        rank = count;
+    }
+    return values[rank - 1];
+}
+
+static int connect_tcp(const char *host, const char *port)
+{
+    struct addrinfo hints, *res;
+    int one = 1;
+    int fd = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int status = getaddrinfo(host, port, &hints, &res);
+    if(status != 0){
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
+        return -1;
+    }
+    fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if(fd != -1 && connect(fd, res->ai_addr, res->ai_addrlen) == -1){
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if(fd != -1){
+        // Each packet is one small write, don't let Nagle batch them
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+static int connect_unix(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    if(strlen(path) >= sizeof(addr.sun_path)){
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd != -1 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1){
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+static int send_all(int fd, const char *data, size_t len)
+{
+    while(len > 0){
+        ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+        if(sent == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        data += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+/**
+ * Receive until what arrived ends with the @param len bytes at @param packet.
+ * @return 0, or -1 if the connection failed or closed.
+ */
+static int recv_echo(struct client *c, const char *packet, size_t len)
+{
+    size_t have = 0;
+
+    while(have < len || memcmp(c->rx_buf + have - len, packet, len) != 0){
+        if(have == c->rx_cap){
+            c->rx_cap = c->rx_cap ? c->rx_cap * 2 : 64 * 1024;
+            c->rx_buf = realloc(c->rx_buf, c->rx_cap);
+            if(!c->rx_buf){
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        ssize_t got = recv(c->fd, c->rx_buf + have, c->rx_cap - have, 0);
+        if(got <= 0){
+            if(got == -1 && errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        have += got;
+    }
+    return 0;
+}
+
+/**
+ * Negotiate the ring on the Unix socket of @param c and map it.
+ * @return 0, or -1 if the server refused or failed.
+ */
+static int shm_setup(struct client *c)
+{
+    char line[64];
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = { .iov_base = line, .iov_len = strlen(SHM_NEGOTIATE_ACK) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    int fds[3];
+
+    if(send_all(c->fd, SHM_NEGOTIATE "\n", strlen(SHM_NEGOTIATE) + 1) == -1){
+        return -1;
+    }
+    ssize_t got = recvmsg(c->fd, &msg, MSG_WAITALL);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if(got != (ssize_t)iov.iov_len || memcmp(line, SHM_NEGOTIATE_ACK, got) != 0 ||
+       !cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(fds))){
+        fprintf(stderr, "Server refused the shm ring\n");
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    c->ring = mmap(NULL, sizeof(struct shm_ring), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+    close(fds[0]);
+    c->submit_fd = fds[1];
+    c->complete_fd = fds[2];
+    if(c->ring == MAP_FAILED){
+        perror("mmap");
+        return -1;
+    }
+    return 0;
+}
+
+// Wait for the completion eventfd, @return -1 if it failed
+static int shm_wait(struct client *c)
+{
+    uint64_t count;
+
+    while(read(c->complete_fd, &count, sizeof(count)) == -1){
+        if(errno != EINTR){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Push one packet into the ring and wait until the server consumed it.
+ * @return 0, or -1 on failure.
+ */
+static int shm_send(struct client *c, const char *packet, size_t len)
+{
+    uint64_t one = 1;
+
+    while(shm_ring_push(c->ring, packet, len) == -1){
+        if(shm_wait(c) == -1){
+            return -1;
+        }
+    }
+    uint64_t head = c->ring->head;
+    if(write(c->submit_fd, &one, sizeof(one)) == -1){
+        return -1;
+    }
+    while(__atomic_load_n(&c->ring->tail, __ATOMIC_ACQUIRE) < head){
+        if(shm_wait(c) == -1){
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Time cfg->packets packets over @param transport into @param samples,
+ * after cfg->warmup untimed ones.  @return 0, or -1 on failure.
+ */
+static int run(const struct bench_config *cfg, enum transport transport, double *samples)
+{
+    struct client c = { .fd = -1, .ring = MAP_FAILED, .submit_fd = -1, .complete_fd = -1 };
+    char *packet = malloc(cfg->size);
+    int rc = -1;
+
+    if(!packet){
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    c.fd = transport == TRANSPORT_TCP ? connect_tcp(cfg->host, cfg->port) : connect_unix(cfg->unix_path);
+    if(c.fd == -1){
+        fprintf(stderr, "%s: connect failed: %s\n", transport_names[transport], strerror(errno));
+        goto out;
+    }
+    if(transport == TRANSPORT_SHM ? shm_setup(&c) == -1 :
+       send_all(c.fd, DELTA_SETUP, strlen(DELTA_SETUP)) == -1){
+        goto out;
+    }
+
+    for(long i = -cfg->warmup; i < cfg->packets; i++){
+        int token_len = snprintf(packet, cfg->size, "%s-%ld:", transport_names[transport], i);
+        memset(packet + token_len, 'x', cfg->size - token_len);
+        packet[cfg->size - 1] = '\n';
+
+        double start = now_us();
+        if(transport == TRANSPORT_SHM){
+            if(shm_send(&c, packet, cfg->size) == -1){
+                goto out;
+            }
+        } else if(send_all(c.fd, packet, cfg->size) == -1 || recv_echo(&c, packet, cfg->size) == -1){
+            goto out;
+        }
+        if(i >= 0){
+            samples[i] = now_us() - start;
+        }
+    }
+    rc = 0;
+
+out:
+    if(rc == -1){
+        fprintf(stderr, "%s: run failed: %s\n", transport_names[transport], strerror(errno));
+    }
+    if(c.ring != MAP_FAILED){
+        munmap(c.ring, sizeof(struct shm_ring));
+    }
+    if(c.submit_fd != -1){
+        close(c.submit_fd);
+    }
+    if(c.complete_fd != -1){
+        close(c.complete_fd);
+    }
+    if(c.fd != -1){
+        close(c.fd);
+    }
+    free(c.rx_buf);
+    free(packet);
+    return rc;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-t tcp|unix|shm|all] [-H host] [-P port] [-U unix_socket_path]"
+            " [-n packets] [-w warmup] [-s size]\n", name);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench_config cfg = {
+        .host = DEFAULT_HOST,
+        .port = DEFAULT_PORT,
+        .unix_path = DEFAULT_UNIX_PATH,
+        .packets = DEFAULT_PACKETS,
+        .warmup = DEFAULT_WARMUP,
+        .size = DEFAULT_SIZE,
+    };
+    bool selected[TRANSPORTS] = { true, true, true };
+    int opt;
+
+    while((opt = getopt(argc, argv, "t:H:P:U:n:w:s:")) != -1){
+        switch(opt){
+            case 't':
+                if(strcmp(optarg, "all") != 0){
+                    bool known = false;
+                    for(int t = 0; t < TRANSPORTS; t++){
+                        selected[t] = strcmp(optarg, transport_names[t]) == 0;
+                        known |= selected[t];
+                    }
+                    if(!known){
+                        usage(argv[0]);
+                    }
+                }
+                break;
+            case 'H':
+                cfg.host = optarg;
+                break;
+            case 'P':
+                cfg.port = optarg;
+                break;
+            case 'U':
+                cfg.unix_path = optarg;
+                break;
+            case 'n':
+                cfg.packets = atol(optarg);
+                break;
+            case 'w':
+                cfg.warmup = atol(optarg);
+                break;
+            case 's':
+                cfg.size = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    // Room for the token and the newline, and a record the ring takes
+    if(cfg.packets < 1 || cfg.warmup < 0 || cfg.size < 32 || cfg.size > SHM_RECORD_MAX){
+        usage(argv[0]);
+    }
+
+    double *samples = malloc(cfg.packets * sizeof(double));
+    if(!samples){
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    int failed = 0;
+    printf("%ld packets of %zu bytes after %ld warmup\n", cfg.packets, cfg.size, cfg.warmup);
+    printf("%-8s %10s %10s %10s %10s %10s\n", "transport", "mean_us", "p50_us", "p99_us", "p999_us", "max_us");
+    for(int t = 0; t < TRANSPORTS; t++){
+        if(!selected[t]){
+            continue;
+        }
+        if(run(&cfg, t, samples) == -1){
+            failed = 1;
+            continue;
+        }
+        double sum = 0;
+        for(long i = 0; i < cfg.packets; i++){
+            sum += samples[i];
+        }
+        qsort(samples, cfg.packets, sizeof(double), cmp_double);
+        printf("%-8s %10.1f %10.1f %10.1f %10.1f %10.1f\n", transport_names[t], sum / cfg.packets,
+               percentile(samples, cfg.packets, 50), percentile(samples, cfg.packets, 99),
+               percentile(samples, cfg.packets, 99.9), samples[cfg.packets - 1]);
+    }
+    free(samples);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,677 @@
+#define _DEFAULT_SOURCE
+#include "sys/socket.h"
+#include "sys/types.h"
+#include "sys/mman.h"
+#include "sys/syscall.h"
+#include "sys/uio.h"
+#include "sys/stat.h"
+#include "linux/io_uring.h"
+#include "syslog.h"
+#include "unistd.h"
+#include "string.h"
+#include "stdlib.h"
+#include "stdint.h"
+#include "errno.h"
+#include "stdbool.h"
+#include "pthread.h"
+#include "sys/ioctl.h"
+#include "aesd_ioctl.h"
+#include "aesdsocket.h"
+#include "connection.h"
+#include "uring_io.h"
+#include "group_commit.h"
+#include "readback_cache.h"
+#include "fanout.h"
+#include "metrics.h"
+#include "aesdlog.h"
+
+#define URING_ENTRIES 8
+
+// Fixed file slots
+#define SLOT_CLIENT 0
+#define SLOT_DATA 1
+#define SLOT_COUNT 2
+
+// Registered buffers, readback alternates between the last two
+#define BUF_RX 0
+#define BUF_READBACK 1
+#define BUF_COUNT 3
+
+// user_data tags, also index the results of a batch
+enum uring_op {
+    OP_RECV,
+    OP_WRITE,
+    OP_READ,
+    OP_SEND,
+    OP_COUNT,
+};
+
+struct uring {
+    int ring_fd;
+    unsigned sq_entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ptr;
+    size_t sq_len;
+    void *cq_ptr;
+    size_t cq_len;
+    size_t sqes_len;
+
+    // SQEs prepared locally, published to the kernel on submit
+    unsigned sq_local_tail;
+    unsigned to_submit;
+
+    char *buf_mem;
+    char *bufs[BUF_COUNT];
+};
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int ring_fd, unsigned opcode, const void *arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+static void uring_destroy(struct uring *ring)
+{
+    if(ring->sqes){
+        munmap(ring->sqes, ring->sqes_len);
+    }
+    if(ring->cq_ptr && ring->cq_ptr != ring->sq_ptr){
+        munmap(ring->cq_ptr, ring->cq_len);
+    }
+    if(ring->sq_ptr){
+        munmap(ring->sq_ptr, ring->sq_len);
+    }
+    close(ring->ring_fd);
+    free(ring->buf_mem);
+    free(ring);
+}
+
+static void *uring_mmap(int ring_fd, size_t len, off_t offset)
+{
+    void *ptr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, offset);
+    return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+static struct uring *uring_create(void)
+{
+    struct io_uring_params params;
+    struct uring *ring = calloc(1, sizeof(struct uring));
+    if(!ring){
+        return NULL;
+    }
+
+    memset(&params, 0, sizeof(params));
+    ring->ring_fd = sys_io_uring_setup(URING_ENTRIES, &params);
+    if(ring->ring_fd == -1){
+        AESD_LOG(LOG_ERR, "io_uring_setup failed: %m");
+        free(ring);
+        return NULL;
+    }
+
+    // Map the submission and completion rings, shared in one mapping on newer kernels
+    ring->sq_entries = params.sq_entries;
+    ring->sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if(params.features & IORING_FEAT_SINGLE_MMAP){
+        if(ring->cq_len > ring->sq_len){
+            ring->sq_len = ring->cq_len;
+        }
+        ring->cq_len = ring->sq_len;
+    }
+
+    ring->sq_ptr = uring_mmap(ring->ring_fd, ring->sq_len, IORING_OFF_SQ_RING);
+    if(!ring->sq_ptr){
+        goto fail;
+    }
+    if(params.features & IORING_FEAT_SINGLE_MMAP){
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = uring_mmap(ring->ring_fd, ring->cq_len, IORING_OFF_CQ_RING);
+        if(!ring->cq_ptr){
+            goto fail;
+        }
+    }
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = uring_mmap(ring->ring_fd, ring->sqes_len, IORING_OFF_SQES);
+    if(!ring->sqes){
+        goto fail;
+    }
+
+    ring->sq_head = (unsigned *)((char *)ring->sq_ptr + params.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ptr + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_ptr + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ptr + params.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq_ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ptr + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ptr + params.cq_off.cqes);
+    ring->sq_local_tail = *ring->sq_tail;
+
+    // Register the receive and readback buffers once for the life of the thread
+    struct iovec iov[BUF_COUNT];
+    ring->buf_mem = malloc(BUF_COUNT * BUFFER_SIZE);
+    if(!ring->buf_mem){
+        goto fail;
+    }
+    for(int i = 0; i < BUF_COUNT; i++){
+        ring->bufs[i] = ring->buf_mem + i * BUFFER_SIZE;
+        iov[i].iov_base = ring->bufs[i];
+        iov[i].iov_len = BUFFER_SIZE;
+    }
+    if(sys_io_uring_register(ring->ring_fd, IORING_REGISTER_BUFFERS, iov, BUF_COUNT) == -1){
+        AESD_LOG(LOG_ERR, "io_uring buffer registration failed: %m");
+        goto fail;
+    }
+
+    // Empty file table, filled in for each connection
+    int fds[SLOT_COUNT] = { -1, -1 };
+    if(sys_io_uring_register(ring->ring_fd, IORING_REGISTER_FILES, fds, SLOT_COUNT) == -1){
+        AESD_LOG(LOG_ERR, "io_uring file registration failed: %m");
+        goto fail;
+    }
+
+    return ring;
+
+fail:
+    uring_destroy(ring);
+    return NULL;
+}
+
+static void uring_key_destroy(void *arg)
+{
+    uring_destroy((struct uring *)arg);
+}
+
+static void uring_key_init(void)
+{
+    pthread_key_create(&ring_key, uring_key_destroy);
+}
+
+// Ring of the calling thread, released when the thread exits
+static struct uring *uring_thread_ring(void)
+{
+    struct uring *ring;
+
+    pthread_once(&ring_key_once, uring_key_init);
+    ring = pthread_getspecific(ring_key);
+    if(!ring){
+        ring = uring_create();
+        if(ring){
+            pthread_setspecific(ring_key, ring);
+        }
+    }
+    return ring;
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring, enum uring_op op, int slot)
+{
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned index;
+    struct io_uring_sqe *sqe;
+
+    // Never more than a handful in flight, the ring is sized well above that
+    if(ring->sq_local_tail - head >= ring->sq_entries){
+        return NULL;
+    }
+
+    index = ring->sq_local_tail & *ring->sq_mask;
+    sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = slot;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->user_data = op;
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+    ring->to_submit++;
+    return sqe;
+}
+
+static void uring_prep_rw(struct io_uring_sqe *sqe, int opcode, int buf_index,
+                          const char *addr, size_t len, off_t offset)
+{
+    sqe->opcode = opcode;
+    sqe->addr = (uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->buf_index = buf_index;
+}
+
+/**
+ * Submit everything prepared and reap @param count completions into
+ * @param res, indexed by enum uring_op.
+ */
+static int uring_run(struct uring *ring, unsigned count, int res[OP_COUNT])
+{
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+    while(ring->to_submit > 0){
+        int submitted = sys_io_uring_enter(ring->ring_fd, ring->to_submit, count, IORING_ENTER_GETEVENTS);
+        if(submitted == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            AESD_LOG(LOG_ERR, "io_uring_enter failed: %m");
+            return -1;
+        }
+        if(submitted == 0){
+            AESD_LOG(LOG_ERR, "io_uring_enter submitted nothing");
+            return -1;
+        }
+        ring->to_submit -= submitted;
+    }
+
+    while(count > 0){
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+        if(head == tail){
+            if(sys_io_uring_enter(ring->ring_fd, 0, 1, IORING_ENTER_GETEVENTS) == -1 && errno != EINTR){
+                AESD_LOG(LOG_ERR, "io_uring_enter wait failed: %m");
+                return -1;
+            }
+            continue;
+        }
+
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        if(cqe->user_data < OP_COUNT){
+            res[cqe->user_data] = cqe->res;
+        }
+        __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+        count--;
+    }
+
+    return 0;
+}
+
+// Point the fixed file slots at this connection, or clear them with -1
+static int uring_set_files(struct uring *ring, int client_fd, int data_fd)
+{
+    int fds[SLOT_COUNT] = { client_fd, data_fd };
+    struct io_uring_files_update update;
+
+    memset(&update, 0, sizeof(update));
+    update.offset = 0;
+    update.fds = (uintptr_t)fds;
+    if(sys_io_uring_register(ring->ring_fd, IORING_REGISTER_FILES_UPDATE, &update, SLOT_COUNT) != SLOT_COUNT){
+        AESD_LOG(LOG_ERR, "io_uring file update failed: %m");
+        return -1;
+    }
+    return 0;
+}
+
+// Receive into the registered rx buffer, conn_shutdown_all() ends the wait
+static ssize_t uring_recv(struct uring *ring)
+{
+    int res[OP_COUNT];
+
+    struct io_uring_sqe *sqe = uring_get_sqe(ring, OP_RECV, SLOT_CLIENT);
+    if(!sqe){
+        return -EBUSY;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->addr = (uintptr_t)ring->bufs[BUF_RX];
+    sqe->len = BUFFER_SIZE;
+
+    if(uring_run(ring, 1, res) == -1){
+        return -EIO;
+    }
+    return res[OP_RECV];
+}
+
+// Send all of @param len bytes, resubmitting after short sends
+static int uring_send_all(struct uring *ring, const char *data, size_t len)
+{
+    int res[OP_COUNT];
+
+    while(len > 0){
+        struct io_uring_sqe *sqe = uring_get_sqe(ring, OP_SEND, SLOT_CLIENT);
+        if(!sqe){
+            return -1;
+        }
+        sqe->opcode = IORING_OP_SEND;
+        sqe->addr = (uintptr_t)data;
+        sqe->len = len;
+        sqe->msg_flags = MSG_NOSIGNAL;
+
+        if(uring_run(ring, 1, res) == -1 || res[OP_SEND] < 0){
+            AESD_LOG(LOG_ERR, "Failed to send data to client");
+            metrics_inc(METRIC_SEND_ERRORS);
+            return -1;
+        }
+        metrics_add(METRIC_BYTES_OUT, res[OP_SEND]);
+        data += res[OP_SEND];
+        len -= res[OP_SEND];
+    }
+    return 0;
+}
+
+// Bytes to read at @param offset, bounded by @param end unless it is negative
+static size_t uring_read_len(off_t offset, off_t end)
+{
+    if(end < 0 || end - offset > BUFFER_SIZE){
+        return BUFFER_SIZE;
+    }
+    return end > offset ? end - offset : 0;
+}
+
+/**
+ * Stream the data fd from @param offset to the client, stopping at
+ * @param end (or at end of file when negative).  @param len is the result
+ * of a read already completed into readback buffer @param buf, or negative
+ * to start with a fresh read.  Each SEND is submitted together with the READ
+ * of the following chunk into the other readback buffer.
+ */
+static ssize_t uring_readback(struct uring *ring, off_t offset, off_t end, int buf, ssize_t len)
+{
+    int res[OP_COUNT];
+    ssize_t total_sent = 0;
+    struct io_uring_sqe *sqe;
+
+    if(len < 0){
+        size_t want = uring_read_len(offset, end);
+        if(want == 0){
+            return 0;
+        }
+        sqe = uring_get_sqe(ring, OP_READ, SLOT_DATA);
+        if(!sqe){
+            return -1;
+        }
+        uring_prep_rw(sqe, IORING_OP_READ_FIXED, buf, ring->bufs[buf], want, offset);
+        if(uring_run(ring, 1, res) == -1){
+            return -1;
+        }
+        len = res[OP_READ];
+    }
+
+    while(len > 0){
+        int next = (buf == BUF_READBACK) ? BUF_READBACK + 1 : BUF_READBACK;
+        size_t want = uring_read_len(offset + len, end);
+
+        sqe = uring_get_sqe(ring, OP_SEND, SLOT_CLIENT);
+        if(!sqe){
+            return -1;
+        }
+        sqe->opcode = IORING_OP_SEND;
+        sqe->addr = (uintptr_t)ring->bufs[buf];
+        sqe->len = len;
+        sqe->msg_flags = MSG_NOSIGNAL;
+
+        res[OP_READ] = 0;
+        if(want > 0){
+            sqe = uring_get_sqe(ring, OP_READ, SLOT_DATA);
+            if(!sqe){
+                return -1;
+            }
+            uring_prep_rw(sqe, IORING_OP_READ_FIXED, next, ring->bufs[next], want, offset + len);
+        }
+
+        if(uring_run(ring, want > 0 ? 2 : 1, res) == -1){
+            return -1;
+        }
+        if(res[OP_SEND] < 0){
+            AESD_LOG(LOG_ERR, "Failed to send data to client");
+            metrics_inc(METRIC_SEND_ERRORS);
+            return total_sent;
+        }
+        metrics_add(METRIC_BYTES_OUT, res[OP_SEND]);
+        if(res[OP_SEND] < len &&
+           uring_send_all(ring, ring->bufs[buf] + res[OP_SEND], len - res[OP_SEND]) == -1){
+            return total_sent;
+        }
+
+        total_sent += len;
+        offset += len;
+        buf = next;
+        len = res[OP_READ];
+    }
+
+    if(len < 0){
+        AESD_LOG(LOG_ERR, "Readback failed: %s", strerror(-len));
+    }
+    return total_sent;
+}
+
+/**
+ * Write @param len bytes at @param data, linked to the first readback read
+ * when @param readback is set.  @param first_read receives that read's
+ * result, or -1 when it has to be reissued.
+ */
+static int uring_write(struct uring *ring, const char *data, size_t len, bool readback, ssize_t *first_read)
+{
+    int res[OP_COUNT];
+    struct io_uring_sqe *sqe;
+
+    // The offset is ignored on both backends: the driver appends every
+    // write wherever the file position is, the data file is opened O_APPEND
+    sqe = uring_get_sqe(ring, OP_WRITE, SLOT_DATA);
+    if(!sqe){
+        return -1;
+    }
+    if(data >= ring->bufs[BUF_RX] && data + len <= ring->bufs[BUF_RX] + BUFFER_SIZE){
+        uring_prep_rw(sqe, IORING_OP_WRITE_FIXED, BUF_RX, data, len, 0);
+    } else {
+        // Command carried over in the connection's rx buffer, not registered
+        uring_prep_rw(sqe, IORING_OP_WRITE, 0, data, len, 0);
+    }
+
+    if(readback){
+        sqe->flags |= IOSQE_IO_LINK;
+        sqe = uring_get_sqe(ring, OP_READ, SLOT_DATA);
+        if(!sqe){
+            return -1;
+        }
+        uring_prep_rw(sqe, IORING_OP_READ_FIXED, BUF_READBACK, ring->bufs[BUF_READBACK], BUFFER_SIZE, 0);
+    }
+
+    if(uring_run(ring, readback ? 2 : 1, res) == -1){
+        return -1;
+    }
+    if(res[OP_WRITE] < 0){
+        AESD_LOG(LOG_ERR, "Failed to write to char device: %s", strerror(-res[OP_WRITE]));
+        return -1;
+    }
+    AESD_LOG(LOG_DEBUG, "Wrote %d bytes to char device", res[OP_WRITE]);
+
+    // A short write breaks the link, the read then has to be issued on its own
+    if(readback){
+        *first_read = res[OP_READ] == -ECANCELED ? -1 : res[OP_READ];
+    }
+    return 0;
+}
+
+static int uring_append(struct aesd_conn *conn, const char *data, size_t len, bool complete)
+{
+    struct uring *ring = (struct uring *)conn->io_ctx;
+    ssize_t first_read = -1;
+    off_t end = -1;
+    off_t from = 0;
+    uint64_t base = 0;
+    uint64_t start = metrics_now();
+
+#ifdef USE_AESD_CHAR_DEVICE
+    // Positions in the device move as it evicts, a delta readback has to
+    // come from a snapshot that knows where it starts in the stream
+    bool link = complete && !conn->delta;
+
+    if(link){
+        base = readback_device_base(conn->data_fd);
+    }
+
+    // Under file_mutex so subscribers are pushed writes in the order the
+    // device stored them
+    pthread_mutex_lock(&file_mutex);
+    if(uring_write(ring, data, len, link, &first_read) == -1){
+        pthread_mutex_unlock(&file_mutex);
+        return -1;
+    }
+    // The ring reads back on its own, the cache only has to know it changed
+    readback_cache_invalidate();
+    fanout_publish(data, len);
+    pthread_mutex_unlock(&file_mutex);
+    if(complete && conn->delta){
+        metrics_observe(HIST_WRITE, start);
+        return conn_readback_packet(conn);
+    }
+#else
+    struct stat st;
+
+    // Only a readback from the start can use the read linked to the write
+    if(complete && conn->delta){
+        from = conn->readback_end;
+    }
+    bool link = complete && from == 0;
+
+    if(group_commit_active()){
+        // Batched by the committer, only the readback goes through the ring
+        end = group_commit_append(data, len);
+        if(end == -1){
+            return -1;
+        }
+    } else {
+        pthread_mutex_lock(&file_mutex);
+        if(uring_write(ring, data, len, link, &first_read) == -1){
+            pthread_mutex_unlock(&file_mutex);
+            return -1;
+        }
+        fanout_publish(data, len);
+        // Snapshot the history length, the rest of the readback runs unlocked
+        if(complete){
+            if(fstat(conn->data_fd, &st) == 0){
+                end = st.st_size;
+            } else {
+                AESD_LOG(LOG_ERR, "Failed to stat data file: %m");
+                complete = false;
+            }
+        }
+        pthread_mutex_unlock(&file_mutex);
+    }
+#endif
+    // With the first read linked to the write this includes that read
+    metrics_observe(HIST_WRITE, start);
+
+    if(complete){
+        start = metrics_now();
+        ssize_t total_sent = uring_readback(ring, from, end, BUF_READBACK, link ? first_read : -1);
+        // On the char device base was read before the write evicted anything,
+        // a delta switched on later repeats those bytes rather than skip any
+        conn->readback_end = base + from + total_sent;
+        metrics_observe(HIST_READBACK, start);
+        AESD_LOG(LOG_DEBUG, "Sent %zd bytes back to client", total_sent);
+    }
+    return 0;
+}
+
+static int uring_seek_readback(struct aesd_conn *conn, const struct aesd_seekto *seekto)
+{
+#ifdef USE_AESD_CHAR_DEVICE
+    struct uring *ring = (struct uring *)conn->io_ctx;
+
+    // No io_uring opcode for driver ioctls, this one stays synchronous
+    if(ioctl(conn->data_fd, AESDCHAR_IOCSEEKTO, seekto) == -1){
+        AESD_LOG(LOG_ERR, "ioctl seek failed: %m");
+        return 0;
+    }
+    uint64_t start = metrics_now();
+    uint64_t base = readback_device_base(conn->data_fd);
+    off_t pos = lseek(conn->data_fd, 0, SEEK_CUR);
+    ssize_t total_sent = uring_readback(ring, pos, -1, BUF_READBACK, -1);
+    conn->readback_end = base + pos + total_sent;
+    metrics_observe(HIST_READBACK, start);
+    AESD_LOG(LOG_DEBUG, "Finished sending seek response, total %zd bytes", total_sent);
+#else
+    AESD_LOG(LOG_WARNING, "Seek command received but not supported in file mode");
+#endif
+    return 0;
+}
+
+static const struct conn_ops uring_ops = {
+    .append = uring_append,
+    .seek_readback = uring_seek_readback,
+};
+
+bool uring_probe(void)
+{
+    static const int required_ops[] = {
+        IORING_OP_RECV, IORING_OP_SEND,
+        IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED,
+    };
+    struct io_uring_params params;
+    struct io_uring_probe *probe;
+    size_t probe_len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    bool supported = true;
+
+    memset(&params, 0, sizeof(params));
+    int ring_fd = sys_io_uring_setup(2, &params);
+    if(ring_fd == -1){
+        AESD_LOG(LOG_WARNING, "io_uring unavailable: %m");
+        return false;
+    }
+
+    probe = calloc(1, probe_len);
+    if(!probe || sys_io_uring_register(ring_fd, IORING_REGISTER_PROBE, probe, 256) == -1){
+        AESD_LOG(LOG_WARNING, "io_uring opcode probe failed: %m");
+        supported = false;
+    } else {
+        for(size_t i = 0; i < sizeof(required_ops) / sizeof(required_ops[0]); i++){
+            int op = required_ops[i];
+            if(op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)){
+                AESD_LOG(LOG_WARNING, "io_uring lacks opcode %d", op);
+                supported = false;
+            }
+        }
+    }
+
+    free(probe);
+    close(ring_fd);
+    return supported;
+}
+
+int uring_serve(struct aesd_conn *conn)
+{
+    struct uring *ring = uring_thread_ring();
+    ssize_t bytes_received;
+
+    if(!ring || uring_set_files(ring, conn->client_fd, conn->data_fd) == -1){
+        return -1;
+    }
+    conn->ops = &uring_ops;
+    conn->io_ctx = ring;
+
+    while((bytes_received = uring_recv(ring)) > 0){
+        if(conn_handle_data(conn, ring->bufs[BUF_RX], bytes_received) == -1){
+            break;
+        }
+    }
+
+    if(bytes_received < 0){
+        AESD_LOG(LOG_ERR, "recv failed: %s", strerror(-bytes_received));
+    } else if(bytes_received == 0){
+        AESD_LOG(LOG_DEBUG, "Client disconnected");
+        conn_finish(conn);
+    }
+
+    // Drop the ring's references so closing the descriptors really closes them
+    uring_set_files(ring, -1, -1);
+    return 0;
+}
@@ -0,0 +1,32 @@
+/*
+ * uring_io.h
+ *
+ *  io_uring data path for the blocking serving modes.  Each serving thread
+ *  owns a small ring with the connection's socket and data fd registered as
+ *  fixed files and its receive/readback buffers registered once.  A packet
+ *  completing with a newline is written and read back through one linked
+ *  WRITE_FIXED -> READ_FIXED submission, the rest of the history is streamed
+ *  with each SEND overlapping the READ of the next chunk.
+ */
+
+#ifndef AESDSOCKET_URING_IO_H
+#define AESDSOCKET_URING_IO_H
+
+#include "stdbool.h"
+#include "connection.h"
+
+/**
+ * Check once at startup that the kernel can run the io_uring data path.
+ * @return true if io_uring can be used.
+ */
+bool uring_probe(void);
+
+/**
+ * Serve @param conn until the client disconnects, using the calling thread's
+ * ring (created on first use).
+ * @return 0 once the connection was served, -1 if no ring is available and
+ * nothing was consumed, so the caller can fall back to the sync path.
+ */
+int uring_serve(struct aesd_conn *conn);
+
+#endif /* AESDSOCKET_URING_IO_H */
@@ -0,0 +1,178 @@
+#define _DEFAULT_SOURCE
+#include "sys/socket.h"
+#include "syslog.h"
+#include "unistd.h"
+#include "stdlib.h"
+#include "errno.h"
+#include "stdbool.h"
+#include "pthread.h"
+#include "aesdsocket.h"
+#include "connection.h"
+#include "worker_pool.h"
+#include "aesdlog.h"
+
+struct worker_pool {
+    pthread_t *workers;
+    int worker_count;
+
+    // Ring of accepted sockets waiting for a worker
+    int *queue;
+    int queue_depth;
+    int head;
+    int count;
+    enum pool_overload overload;
+
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    bool stopping;
+};
+
+static struct worker_pool pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .not_empty = PTHREAD_COND_INITIALIZER,
+    .not_full = PTHREAD_COND_INITIALIZER,
+};
+
+// Caller holds pool.lock and has checked there is something queued
+static int pool_dequeue(void)
+{
+    int fd = pool.queue[pool.head];
+
+    pool.head = (pool.head + 1) % pool.queue_depth;
+    pool.count--;
+    return fd;
+}
+
+static void *worker_thread_func(void *arg)
+{
+    while(true){
+        int client_fd;
+        struct aesd_conn conn;
+
+        pthread_mutex_lock(&pool.lock);
+        // worker_pool_stop() broadcasts, no need to poll exit_flag
+        while(pool.count == 0 && !pool.stopping){
+            pthread_cond_wait(&pool.not_empty, &pool.lock);
+        }
+        if(pool.count == 0){
+            pthread_mutex_unlock(&pool.lock);
+            break;
+        }
+        client_fd = pool_dequeue();
+        pthread_cond_signal(&pool.not_full);
+        pthread_mutex_unlock(&pool.lock);
+
+        if(conn_open(&conn, client_fd, false) == -1){
+            conn_drop(client_fd);
+            continue;
+        }
+        conn_serve(&conn);
+        conn_close(&conn);
+    }
+
+    pthread_exit(NULL);
+}
+
+int worker_pool_start(int workers, int queue_depth, enum pool_overload overload)
+{
+    pool.queue = calloc(queue_depth, sizeof(int));
+    pool.workers = calloc(workers, sizeof(pthread_t));
+    if(!pool.queue || !pool.workers){
+        AESD_LOG(LOG_ERR, "Failed to allocate worker pool");
+        free(pool.queue);
+        free(pool.workers);
+        return -1;
+    }
+    pool.queue_depth = queue_depth;
+    pool.overload = overload;
+    pool.head = 0;
+    pool.count = 0;
+    pool.stopping = false;
+
+    for(int i = 0; i < workers; i++){
+        if(pthread_create(&pool.workers[i], NULL, worker_thread_func, NULL) != 0){
+            AESD_LOG(LOG_ERR, "Failed to create worker thread");
+            break;
+        }
+        pool.worker_count++;
+    }
+
+    if(pool.worker_count == 0){
+        free(pool.queue);
+        free(pool.workers);
+        return -1;
+    }
+    if(pool.worker_count < workers){
+        AESD_LOG(LOG_WARNING, "Started %d of %d workers", pool.worker_count, workers);
+    }
+    AESD_LOG(LOG_INFO, "Serving connections from %d workers, queue depth %d",
+           pool.worker_count, queue_depth);
+    return 0;
+}
+
+int worker_pool_submit(int client_fd)
+{
+    int dropped_fd = -1;
+
+    pthread_mutex_lock(&pool.lock);
+
+    if(pool.count == pool.queue_depth){
+        switch(pool.overload){
+            case OVERLOAD_BLOCK:
+                // Workers keep dequeuing during shutdown, connections
+                // opened then are shut down right away
+                while(pool.count == pool.queue_depth && !pool.stopping){
+                    pthread_cond_wait(&pool.not_full, &pool.lock);
+                }
+                if(pool.count == pool.queue_depth){
+                    dropped_fd = client_fd;
+                }
+                break;
+            case OVERLOAD_REJECT:
+                dropped_fd = client_fd;
+                break;
+            case OVERLOAD_SHED:
+                dropped_fd = pool_dequeue();
+                break;
+        }
+    }
+
+    if(dropped_fd != client_fd){
+        int tail = (pool.head + pool.count) % pool.queue_depth;
+        pool.queue[tail] = client_fd;
+        pool.count++;
+        pthread_cond_signal(&pool.not_empty);
+    }
+
+    pthread_mutex_unlock(&pool.lock);
+
+    if(dropped_fd != -1){
+        AESD_LOG(LOG_WARNING, "Worker queue full, dropping connection");
+        conn_drop(dropped_fd);
+    }
+    return dropped_fd == client_fd ? -1 : 0;
+}
+
+void worker_pool_stop(void)
+{
+    pthread_mutex_lock(&pool.lock);
+    pool.stopping = true;
+    // Nobody will serve what is still queued
+    while(pool.count > 0){
+        conn_drop(pool_dequeue());
+    }
+    pthread_cond_broadcast(&pool.not_empty);
+    pthread_cond_broadcast(&pool.not_full);
+    pthread_mutex_unlock(&pool.lock);
+
+    for(int i = 0; i < pool.worker_count; i++){
+        pthread_join(pool.workers[i], NULL);
+    }
+
+    free(pool.workers);
+    free(pool.queue);
+    pool.workers = NULL;
+    pool.queue = NULL;
+    pool.worker_count = 0;
+}
@@ -0,0 +1,36 @@
+/*
+ * worker_pool.h
+ *
+ *  Fixed-size pool of client threads fed by a bounded queue of accepted
+ *  sockets, so connection setup no longer pays for pthread_create.
+ */
+
+#ifndef AESDSOCKET_WORKER_POOL_H
+#define AESDSOCKET_WORKER_POOL_H
+
+// What to do with a new connection while the queue is full
+enum pool_overload {
+    OVERLOAD_BLOCK,     // Stop accepting until a worker frees a slot
+    OVERLOAD_REJECT,    // Close the new connection
+    OVERLOAD_SHED,      // Close the oldest queued connection to admit the new one
+};
+
+/**
+ * Start @param workers threads serving a queue of @param queue_depth sockets.
+ * @return 0 on success, -1 if no worker could be started.
+ */
+int worker_pool_start(int workers, int queue_depth, enum pool_overload overload);
+
+/**
+ * Queue an accepted @param client_fd for the next idle worker, applying the
+ * overload policy when the queue is full.  The pool owns the fd from here on.
+ * @return 0 if queued, -1 if the connection was dropped.
+ */
+int worker_pool_submit(int client_fd);
+
+/**
+ * Wake and join the workers, closing any connection still queued.
+ */
+void worker_pool_stop(void);
+
+#endif /* AESDSOCKET_WORKER_POOL_H */